@@ -26,17 +26,66 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef MAP_ENABLE_LOG
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#ifdef MAP_ENABLE_PARALLEL
+#   include <pthread.h>
+#endif
 
 typedef enum
 {
     MAP_SUCCESS = 0,
     MAP_INPUT_OUT_OF_RANGE,
     MAP_ALLOC_FAILURE,
-    MAP_KEY_NOT_FOUND
+    MAP_KEY_NOT_FOUND,
+    MAP_FREEZE_FAILURE,
+    MAP_IO_FAILURE
 } MAP_STATUS;
 
+typedef struct
+{
+    size_t queries;         /* lookups that consulted the prefilter */
+    size_t negatives;       /* lookups answered by the prefilter alone */
+    size_t false_positives; /* lookups that passed the prefilter but missed */
+    double hit_rate;        /* negatives / queries */
+} MAP_FILTER_STATS;
+
+typedef struct
+{
+    uint8_t* counters;  /* 4 bit saturating counters, two per byte */
+    size_t nblocks;     /* number of cache line sized blocks of counters */
+    unsigned nhashes;   /* counters touched per key, all in one block */
+    MAP_FILTER_STATS stats;
+} map_filter;
+
+typedef struct
+{
+    int fd;             /* log file, opened for appending */
+    char* path;
+    size_t key_size;
+    size_t value_size;
+    size_t batch;       /* records per group commit */
+    size_t pending;     /* records buffered since the last commit */
+    char* buffer;       /* room for batch records */
+    bool failed;        /* a commit failed, so nothing more is appended */
+} map_log;
+
+typedef struct
+{
+    uint64_t seed;
+    size_t nkeys;     /* number of distinct hashes, the range of the hash */
+    size_t nslots;    /* slots the pilots search, a few more than nkeys */
+    size_t nbuckets;  /* length of pilots */
+    uint32_t* pilots; /* per bucket displacement */
+    size_t* remap;    /* a free slot below nkeys for each slot from nkeys on */
+} map_mph;
+
 #define map_elem(KEY_TYPE, VALUE_TYPE)                                         \
     struct{KEY_TYPE _key; VALUE_TYPE _value; size_t _hash; bool _in_use;}
 
@@ -50,6 +99,8 @@ struct                                                                         \
     map_elem(KEY_TYPE, VALUE_TYPE) _tmp;                                       \
     size_t (*_hash_f)(void*); /* hashes a key of type KEY_TYPE to an index */  \
     bool (*_key_eq_f)(void*, void*); /* returns true if two keys are equal */  \
+    map_filter* _filter; /* optional lookup prefilter, NULL if disabled */     \
+    map_log* _log; /* optional write-ahead log, NULL if disabled */            \
 }
 
 #define map_init(/* map(KEY_TYPE, VALUE_TYPE) */map,                           \
@@ -84,6 +135,178 @@ struct                                                                         \
 #define map_keys(/* KEY_TYPE[] */ans, /* map(KEY_TYPE, VALUE_TYPE) */map)      \
                                                          _map_keys((ans), (map))
 
+#ifdef MAP_ENABLE_PARALLEL
+// Parallel traversal, only available when MAP_ENABLE_PARALLEL is defined
+// before including map.h. The table is split into index ranges that start on
+// cache line boundaries and each range is walked by its own thread. fn/fold_f
+// are called as f(KEY_TYPE* key, VALUE_TYPE* value, void* ctx_or_acc).
+#define map_parallel_for(/* map(KEY_TYPE, VALUE_TYPE) */map,                   \
+    /* void (*)(void*, void*, void*) */fn, /* void* */ctx,                     \
+    /* unsigned */nthreads)                                                    \
+                                     _map_parallel_for((map), fn, ctx, nthreads)
+
+#define map_parallel_reduce(/* ACC_TYPE */ans,                                 \
+    /* map(KEY_TYPE, VALUE_TYPE) */map,                                        \
+    /* void (*)(void*, void*, void*) */fold_f,                                 \
+    /* void (*)(void*, void*) */combine_f, /* unsigned */nthreads)             \
+                 _map_parallel_reduce((ans), (map), fold_f, combine_f, nthreads)
+
+#define map_ool_parallel_for(/* map_ool(KEY_TYPE, VALUE_TYPE) */map,           \
+    /* void (*)(void*, void*, void*) */fn, /* void* */ctx,                     \
+    /* unsigned */nthreads)                                                    \
+                                 _map_ool_parallel_for((map), fn, ctx, nthreads)
+
+#define map_ool_parallel_reduce(/* ACC_TYPE */ans,                             \
+    /* map_ool(KEY_TYPE, VALUE_TYPE) */map,                                    \
+    /* void (*)(void*, void*, void*) */fold_f,                                 \
+    /* void (*)(void*, void*) */combine_f, /* unsigned */nthreads)             \
+             _map_ool_parallel_reduce((ans), (map), fold_f, combine_f, nthreads)
+#endif // MAP_ENABLE_PARALLEL
+
+// Out-of-line value mode. The table holds only keys, hash metadata and a 32
+// bit index into a value slab, keeping probing and displacement compact for
+// large value types. map_key_exists, map_length, map_load_factor and map_keys
+// work on these maps as well.
+#define map_slab_elem(VALUE_TYPE)                                              \
+    struct{VALUE_TYPE _value; uint32_t _next_free; bool _in_use;}
+
+#define map_ool(KEY_TYPE, VALUE_TYPE)                                          \
+struct                                                                         \
+{                                                                              \
+    MAP_STATUS status;                                                         \
+    unsigned _bits; /* lg of the length of _table array */                     \
+    size_t _nelem;  /* number of key/value pairs currently in the table */     \
+    map_elem(KEY_TYPE, uint32_t)* _table; /* _value is an index into _slab */  \
+    map_elem(KEY_TYPE, uint32_t) _tmp;                                         \
+    size_t (*_hash_f)(void*); /* hashes a key of type KEY_TYPE to an index */  \
+    bool (*_key_eq_f)(void*, void*); /* returns true if two keys are equal */  \
+    map_filter* _filter; /* optional lookup prefilter, NULL if disabled */     \
+    map_slab_elem(VALUE_TYPE)* _slab; /* values, never moved once set */       \
+    uint32_t _slab_top;  /* number of slab slots handed out so far */          \
+    uint32_t _free_head; /* first slot of the free list threaded thru _slab */ \
+}
+
+#define map_ool_init(/* map_ool(KEY_TYPE, VALUE_TYPE) */map,                   \
+    /* size_t (*)(void*) */hash_f, /* bool (*)(void*, void*) */key_eq_f,       \
+    /* unsigned */num_bits)                                                    \
+                                _map_ool_init((map), hash_f, key_eq_f, num_bits)
+
+#define map_ool_deinit(/* map_ool(KEY_TYPE, VALUE_TYPE) */map)                 \
+                                                          _map_ool_deinit((map))
+
+#define map_ool_set(/* map_ool(KEY_TYPE, VALUE_TYPE) */map, /* KEY_TYPE */key, \
+    /* VALUE_TYPE */value)                                                     \
+                                                 _map_ool_set((map), key, value)
+
+#define map_ool_get(/* VALUE_TYPE */ans,                                       \
+    /* map_ool(KEY_TYPE, VALUE_TYPE) */map, /* KEY_TYPE */key)                 \
+                                                 _map_ool_get((ans), (map), key)
+
+#define map_ool_ref(/* VALUE_TYPE* */ans,                                      \
+    /* map_ool(KEY_TYPE, VALUE_TYPE) */map, /* KEY_TYPE */key)                 \
+                                                 _map_ool_ref((ans), (map), key)
+
+#define map_ool_remove(/* map_ool(KEY_TYPE, VALUE_TYPE) */map,                 \
+    /* KEY_TYPE */key)                                                         \
+                                                     _map_ool_remove((map), key)
+
+#define map_ool_values(/* VALUE_TYPE[] */ans,                                  \
+    /* map_ool(KEY_TYPE, VALUE_TYPE) */map)                                    \
+                                                   _map_ool_values((ans), (map))
+
+// Frozen maps. map_freeze builds an immutable copy of a map around a minimal
+// perfect hash of its key hashes, so a lookup is one slot access and one key
+// comparison (more only for keys whose hashes collide) and the table has no
+// empty slots. map_length works on frozen maps as well.
+#define map_frozen_elem(KEY_TYPE, VALUE_TYPE)                                  \
+    struct{KEY_TYPE _key; VALUE_TYPE _value;}
+
+#define map_frozen(KEY_TYPE, VALUE_TYPE)                                       \
+struct                                                                         \
+{                                                                              \
+    MAP_STATUS status;                                                         \
+    size_t _nelem;  /* number of key/value pairs, also length of _table */     \
+    map_mph _mph;   /* minimal perfect hash of the distinct key hashes */      \
+    size_t* _groups; /* _table range of each key hash, NULL if all distinct */ \
+    map_frozen_elem(KEY_TYPE, VALUE_TYPE)* _table;                             \
+    map_frozen_elem(KEY_TYPE, VALUE_TYPE) _tmp;                                \
+    size_t (*_hash_f)(void*); /* hashes a key of type KEY_TYPE to an index */  \
+    bool (*_key_eq_f)(void*, void*); /* returns true if two keys are equal */  \
+}
+
+#define map_freeze(/* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen,               \
+    /* map(KEY_TYPE, VALUE_TYPE) */map)                                        \
+                                                    _map_freeze((frozen), (map))
+
+#define map_frozen_deinit(/* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen)        \
+                                                    _map_frozen_deinit((frozen))
+
+#define map_frozen_get(/* VALUE_TYPE */ans,                                    \
+    /* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen, /* KEY_TYPE */key)           \
+                                           _map_frozen_get((ans), (frozen), key)
+
+#define map_frozen_key_exists(/* bool */ans,                                   \
+    /* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen, /* KEY_TYPE */key)           \
+                                    _map_frozen_key_exists((ans), (frozen), key)
+
+#define map_frozen_write(/* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen,         \
+    /* FILE* */file)                                                           \
+                                               _map_frozen_write((frozen), file)
+
+#define map_frozen_read(/* map_frozen(KEY_TYPE, VALUE_TYPE) */frozen,          \
+    /* FILE* */file, /* size_t (*)(void*) */hash_f,                            \
+    /* bool (*)(void*, void*) */key_eq_f)                                      \
+                              _map_frozen_read((frozen), file, hash_f, key_eq_f)
+
+// Lookup prefilter. An optional counting blocked Bloom filter, kept in sync by
+// set/remove, that lets most lookups of missing keys skip the table entirely.
+// Works on both map and map_ool.
+#define map_filter_enable(/* map(KEY_TYPE, VALUE_TYPE) */map,                  \
+    /* double */fp_rate)                                                       \
+                                              _map_filter_enable((map), fp_rate)
+
+#define map_filter_disable(/* map(KEY_TYPE, VALUE_TYPE) */map)                 \
+                                                      _map_filter_disable((map))
+
+#define map_filter_stats(/* MAP_FILTER_STATS */ans,                            \
+    /* map(KEY_TYPE, VALUE_TYPE) */map)                                        \
+                                                 _map_filter_stats((ans), (map))
+
+// Merges src into dst, reusing the hashes stored in src when both maps use
+// the same hash function. dst is grown up front if needed, so the merged
+// contents fit under MAP_MERGE_MAX_LOAD. For keys in both maps, conflict_f
+// is called as conflict_f(&dst_value, &src_value) to update dst_value in
+// place. If conflict_f is NULL, the value from src wins.
+#define map_merge(/* map(KEY_TYPE, VALUE_TYPE) */dst,                          \
+    /* map(KEY_TYPE, VALUE_TYPE) */src,                                        \
+    /* void (*)(void*, void*) */conflict_f)                                    \
+                                            _map_merge((dst), (src), conflict_f)
+
+#ifdef MAP_ENABLE_LOG
+// Write-ahead log, only available when MAP_ENABLE_LOG is defined before
+// including map.h. map_set and map_remove append fixed size records to an
+// append-only file that is written and fsynced once per batch of records.
+// map_log_compact folds the log into a snapshot, and map_log_replay rebuilds a
+// map from both at startup. Keys and values are stored byte for byte.
+#define map_log_open(/* map(KEY_TYPE, VALUE_TYPE) */map,                       \
+    /* const char* */path, /* size_t */batch)                                  \
+                                               _map_log_open((map), path, batch)
+
+#define map_log_sync(/* map(KEY_TYPE, VALUE_TYPE) */map)                       \
+                                                            _map_log_sync((map))
+
+#define map_log_close(/* map(KEY_TYPE, VALUE_TYPE) */map)                      \
+                                                           _map_log_close((map))
+
+#define map_log_compact(/* map(KEY_TYPE, VALUE_TYPE) */map,                    \
+    /* const char* */snapshot_path)                                            \
+                                          _map_log_compact((map), snapshot_path)
+
+#define map_log_replay(/* map(KEY_TYPE, VALUE_TYPE) */map,                     \
+    /* const char* */snapshot_path, /* const char* */log_path)                 \
+                                 _map_log_replay((map), snapshot_path, log_path)
+#endif // MAP_ENABLE_LOG
+
 // Hash/eq functions for built in types.
 static size_t int32_hash(void* key);
 static bool   int32_eq(void* i1, void* i2);
@@ -95,10 +318,26 @@ static bool   str_eq(void* str1, void* str2);
 ///////////////////////////////// DEFINITIONS //////////////////////////////////
 #define MAP_DEFAULT_BITS 16
 #define MAP_BITS_PER_SIZE_T (sizeof(size_t)*CHAR_BIT)
+#define MAP_CACHE_LINE 64
 
 static inline size_t _map_pow2(unsigned x)
 {
-    return (size_t)(1 << x);
+    return (size_t)1 << x;
+}
+
+// Returns len zeroed elements of elem_size bytes starting on a cache line
+// boundary, so that ranges of the table can be given to separate threads.
+static inline void* _map_table_alloc(size_t len, size_t elem_size)
+{
+    if (elem_size && len > (SIZE_MAX - MAP_CACHE_LINE) / elem_size)
+        return NULL;
+    /* aligned_alloc needs a size that is a multiple of the alignment */
+    size_t size = (len*elem_size + MAP_CACHE_LINE - 1) / MAP_CACHE_LINE
+        * MAP_CACHE_LINE;
+    void* table = aligned_alloc(MAP_CACHE_LINE, size);
+    if (table)
+        memset(table, 0, size);
+    return table;
 }
 
 static inline size_t _map_dib(size_t hash, size_t curr, unsigned table_bits)
@@ -117,11 +356,455 @@ static inline void _map_memswap(void* p1, void* p2, size_t sz)
     }
 }
 
+static inline uint64_t _map_mix(uint64_t x)
+{
+    /* splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return x;
+}
+
+#define MAP_FILTER_BLOCK_COUNTERS (MAP_CACHE_LINE * 2)
+#define MAP_FILTER_MAX_HASHES 16
+#define MAP_FILTER_COUNTER_MAX 15 /* saturated counters are never decremented */
+
+// Sizes a counting blocked Bloom filter for capacity keys. All counters for a
+// key live in a single cache line, picked by the key's hash.
+static inline MAP_STATUS _map_filter_create(map_filter** filter,
+    size_t capacity, double fp_rate)
+{
+    /* optimal Bloom filter: lg(1/p) hashes, lg(1/p)/ln(2) counters per key */
+    unsigned nhashes = 0;
+    for (double p = 1.0; p > fp_rate && nhashes < MAP_FILTER_MAX_HASHES;
+        p /= 2)
+    {
+        ++nhashes;
+    }
+    double counters_per_key = nhashes * 1.4426950408889634;
+    size_t nblocks = (size_t)(capacity * counters_per_key /
+        MAP_FILTER_BLOCK_COUNTERS) + 1;
+
+    map_filter* f = calloc(1, sizeof(map_filter));
+    if (!f)
+        return MAP_ALLOC_FAILURE;
+    f->counters = aligned_alloc(MAP_CACHE_LINE, nblocks * MAP_CACHE_LINE);
+    if (!f->counters)
+    {
+        free(f);
+        return MAP_ALLOC_FAILURE;
+    }
+    memset(f->counters, 0, nblocks * MAP_CACHE_LINE);
+    f->nblocks = nblocks;
+    f->nhashes = nhashes;
+    *filter = f;
+    return MAP_SUCCESS;
+}
+
+static inline void _map_filter_destroy(map_filter* filter)
+{
+    if (filter)
+        free(filter->counters);
+    free(filter);
+}
+
+// Returns the block for hash and sets *first/*step so that counter i of the
+// key is (*first + i * *step) % MAP_FILTER_BLOCK_COUNTERS. The step is odd, so
+// a key never uses the same counter twice.
+static inline uint8_t* _map_filter_block(map_filter* filter, size_t hash,
+    unsigned* first, unsigned* step)
+{
+    uint64_t h = _map_mix((uint64_t)hash);
+    uint64_t probe = _map_mix(h ^ UINT64_C(0x9e3779b97f4a7c15));
+    *first = (unsigned)(probe % MAP_FILTER_BLOCK_COUNTERS);
+    *step = (unsigned)((probe >> 32) % MAP_FILTER_BLOCK_COUNTERS) | 1;
+    return filter->counters + (h % filter->nblocks) * MAP_CACHE_LINE;
+}
+
+static inline unsigned _map_filter_counter(uint8_t* block, unsigned pos)
+{
+    return (block[pos / 2] >> (pos % 2 * 4)) & 0xF;
+}
+
+static inline void _map_filter_add(map_filter* filter, size_t hash)
+{
+    unsigned first, step;
+    uint8_t* block = _map_filter_block(filter, hash, &first, &step);
+    for (unsigned i = 0; i < filter->nhashes; ++i)
+    {
+        unsigned pos = (first + i*step) % MAP_FILTER_BLOCK_COUNTERS;
+        if (_map_filter_counter(block, pos) < MAP_FILTER_COUNTER_MAX)
+            block[pos / 2] += (uint8_t)(1 << (pos % 2 * 4));
+    }
+}
+
+static inline void _map_filter_remove(map_filter* filter, size_t hash)
+{
+    unsigned first, step;
+    uint8_t* block = _map_filter_block(filter, hash, &first, &step);
+    for (unsigned i = 0; i < filter->nhashes; ++i)
+    {
+        unsigned pos = (first + i*step) % MAP_FILTER_BLOCK_COUNTERS;
+        unsigned counter = _map_filter_counter(block, pos);
+        if (counter > 0 && counter < MAP_FILTER_COUNTER_MAX)
+            block[pos / 2] -= (uint8_t)(1 << (pos % 2 * 4));
+    }
+}
+
+// Returns false only if no key with this hash is in the filter.
+// Only lookups made by the user are counted in the stats, so that hit_rate
+// is not skewed by the lookups map_ool_set and friends make internally.
+static inline bool _map_filter_query(map_filter* filter, size_t hash,
+    bool counted)
+{
+    unsigned first, step;
+    uint8_t* block = _map_filter_block(filter, hash, &first, &step);
+    filter->stats.queries += counted;
+    for (unsigned i = 0; i < filter->nhashes; ++i)
+    {
+        unsigned pos = (first + i*step) % MAP_FILTER_BLOCK_COUNTERS;
+        if (_map_filter_counter(block, pos) == 0)
+        {
+            filter->stats.negatives += counted;
+            return false;
+        }
+    }
+    return true;
+}
+
+#define MAP_LOG_SET 'S'
+#define MAP_LOG_REMOVE 'R'
+
+#ifdef MAP_ENABLE_LOG
+#define MAP_LOG_MAGIC "GCML"
+#define MAP_SNAPSHOT_MAGIC "GCMS"
+#define MAP_LOG_VERSION 1
+#define MAP_LOG_HEADER_SIZE 24 /* magic, version, key size, value size */
+#define MAP_SNAPSHOT_CHUNK 4096 /* records per write while compacting */
+
+static inline bool _map_write_all(int fd, const char* buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return false;
+        buf += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+static inline bool _map_fsync(int fd)
+{
+    int result;
+    while ((result = fsync(fd)) != 0 && errno == EINTR)
+        ;
+    return result == 0;
+}
+
+// Syncs the directory holding path, which makes a file created in it or
+// renamed into it durable.
+static inline bool _map_fsync_dir(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 1;
+    char* dir = malloc(len + 2);
+    if (!dir)
+        return false;
+    if (!slash)
+        memcpy(dir, ".", 2);
+    else if (len == 0)
+        memcpy(dir, "/", 2);
+    else
+    {
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return false;
+    bool ok = _map_fsync(fd);
+    return close(fd) == 0 && ok;
+}
+
+static inline void _map_log_header(char* header, const char* magic,
+    size_t key_size, size_t value_size)
+{
+    uint32_t version = MAP_LOG_VERSION;
+    uint64_t sizes[2] = {key_size, value_size};
+    memcpy(header, magic, 4);
+    memcpy(header + 4, &version, sizeof(version));
+    memcpy(header + 8, sizes, sizeof(sizes));
+}
+
+// Reads and checks a log or snapshot header. Sets *empty for an empty file.
+static inline MAP_STATUS _map_log_read_header(FILE* file, const char* magic,
+    size_t key_size, size_t value_size, bool* empty)
+{
+    char expected[MAP_LOG_HEADER_SIZE];
+    char header[MAP_LOG_HEADER_SIZE];
+    _map_log_header(expected, magic, key_size, value_size);
+    size_t got = fread(header, 1, MAP_LOG_HEADER_SIZE, file);
+    *empty = got == 0;
+    if (*empty)
+        return MAP_SUCCESS;
+    if (got != MAP_LOG_HEADER_SIZE || memcmp(header, expected, 8) != 0)
+        return MAP_IO_FAILURE;
+    if (memcmp(header, expected, MAP_LOG_HEADER_SIZE) != 0)
+        return MAP_INPUT_OUT_OF_RANGE;
+    return MAP_SUCCESS;
+}
+
+// Writes the first len bytes of file to a temporary file and renames it over
+// path. Used to drop a record torn by a crash before appending after it.
+static inline MAP_STATUS _map_log_rewrite_prefix(FILE* file, const char* path,
+    long len)
+{
+    size_t path_len = strlen(path);
+    char* tmp_path = malloc(path_len + 5);
+    char* buf = malloc(BUFSIZ);
+    int fd = -1;
+    MAP_STATUS status = MAP_ALLOC_FAILURE;
+    if (!tmp_path || !buf)
+        goto done;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    status = MAP_IO_FAILURE;
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || fseek(file, 0, SEEK_SET) != 0)
+        goto done;
+    while (len > 0)
+    {
+        size_t want = len < BUFSIZ ? (size_t)len : BUFSIZ;
+        if (fread(buf, 1, want, file) != want || !_map_write_all(fd, buf, want))
+            goto done;
+        len -= (long)want;
+    }
+    if (_map_fsync(fd) && close(fd) == 0 && rename(tmp_path, path) == 0 &&
+        _map_fsync_dir(path))
+    {
+        status = MAP_SUCCESS;
+    }
+    fd = -1;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    free(tmp_path);
+    free(buf);
+    return status;
+}
+
+static inline MAP_STATUS _map_log_create(map_log** log, const char* path,
+    size_t key_size, size_t value_size, size_t batch)
+{
+    if (batch == 0)
+        return MAP_INPUT_OUT_OF_RANGE;
+    size_t record_size = 1 + key_size + value_size;
+
+    /* check an existing log and cut off a record torn by a crash */
+    bool fresh = true;
+    FILE* file = fopen(path, "rb");
+    if (file)
+    {
+        MAP_STATUS status = _map_log_read_header(file, MAP_LOG_MAGIC, key_size,
+            value_size, &fresh);
+        long size = 0;
+        if (status == MAP_SUCCESS && !fresh)
+        {
+            if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0)
+                status = MAP_IO_FAILURE;
+        }
+        long whole = size - (size - MAP_LOG_HEADER_SIZE) % (long)record_size;
+        if (status == MAP_SUCCESS && !fresh && whole != size)
+            status = _map_log_rewrite_prefix(file, path, whole);
+        fclose(file);
+        if (status != MAP_SUCCESS)
+            return status;
+    }
+
+    map_log* l = calloc(1, sizeof(map_log));
+    if (!l)
+        return MAP_ALLOC_FAILURE;
+    l->path = malloc(strlen(path) + 1);
+    l->buffer = malloc(batch * record_size);
+    if (!l->path || !l->buffer)
+    {
+        free(l->path);
+        free(l->buffer);
+        free(l);
+        return MAP_ALLOC_FAILURE;
+    }
+    strcpy(l->path, path);
+    l->key_size = key_size;
+    l->value_size = value_size;
+    l->batch = batch;
+
+    char header[MAP_LOG_HEADER_SIZE];
+    _map_log_header(header, MAP_LOG_MAGIC, key_size, value_size);
+    l->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (fresh ? O_TRUNC : 0),
+        0644);
+    if (l->fd < 0 || (fresh &&
+        (!_map_write_all(l->fd, header, MAP_LOG_HEADER_SIZE) ||
+        !_map_fsync(l->fd) || !_map_fsync_dir(path))))
+    {
+        if (l->fd >= 0)
+            close(l->fd);
+        free(l->path);
+        free(l->buffer);
+        free(l);
+        return MAP_IO_FAILURE;
+    }
+    *log = l;
+    return MAP_SUCCESS;
+}
+
+// Group commit: writes every buffered record and syncs them with one fsync.
+// A failed write can leave part of a record at the end of the file, and
+// anything appended after it would be misread by a replay. So after a failure
+// the log takes no more records, and the partial record stays the torn tail
+// that map_log_open and map_log_replay already handle.
+static inline MAP_STATUS _map_log_commit(map_log* log)
+{
+    if (log->failed)
+        return MAP_IO_FAILURE;
+    if (!log->pending)
+        return MAP_SUCCESS;
+    size_t len = log->pending * (1 + log->key_size + log->value_size);
+    log->pending = 0;
+    if (!_map_write_all(log->fd, log->buffer, len) || !_map_fsync(log->fd))
+    {
+        log->failed = true;
+        return MAP_IO_FAILURE;
+    }
+    return MAP_SUCCESS;
+}
+
+static inline MAP_STATUS _map_log_append(map_log* log, char op,
+    const void* key, const void* value)
+{
+    if (log->failed)
+        return MAP_IO_FAILURE;
+    char* record =
+        log->buffer + log->pending * (1 + log->key_size + log->value_size);
+    record[0] = op;
+    memcpy(record + 1, key, log->key_size);
+    if (value)
+        memcpy(record + 1 + log->key_size, value, log->value_size);
+    else
+        memset(record + 1 + log->key_size, 0, log->value_size);
+    if (++(log->pending) == log->batch)
+        return _map_log_commit(log);
+    return MAP_SUCCESS;
+}
+
+// Empties the log once its records are covered by a snapshot. This also
+// clears a failed commit, since the snapshot holds everything it lost.
+static inline MAP_STATUS _map_log_truncate(map_log* log)
+{
+    char header[MAP_LOG_HEADER_SIZE];
+    _map_log_header(header, MAP_LOG_MAGIC, log->key_size, log->value_size);
+    if (log->fd >= 0)
+        close(log->fd);
+    log->pending = 0;
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    log->failed = log->fd < 0 ||
+        !_map_write_all(log->fd, header, MAP_LOG_HEADER_SIZE) ||
+        !_map_fsync(log->fd);
+    return log->failed ? MAP_IO_FAILURE : MAP_SUCCESS;
+}
+
+static inline MAP_STATUS _map_log_destroy(map_log* log)
+{
+    if (!log)
+        return MAP_SUCCESS;
+    MAP_STATUS status = _map_log_commit(log);
+    if (log->fd >= 0 && close(log->fd) != 0)
+        status = MAP_IO_FAILURE;
+    free(log->path);
+    free(log->buffer);
+    free(log);
+    return status;
+}
+
+// Opens path.tmp and writes a snapshot header for count records to it.
+static inline int _map_snapshot_open(const char* path, char** tmp_path,
+    size_t key_size, size_t value_size, size_t count)
+{
+    size_t path_len = strlen(path);
+    *tmp_path = malloc(path_len + 5);
+    if (!*tmp_path)
+        return -1;
+    memcpy(*tmp_path, path, path_len);
+    memcpy(*tmp_path + path_len, ".tmp", 5);
+
+    char header[MAP_LOG_HEADER_SIZE + sizeof(uint64_t)];
+    uint64_t count64 = count;
+    _map_log_header(header, MAP_SNAPSHOT_MAGIC, key_size, value_size);
+    memcpy(header + MAP_LOG_HEADER_SIZE, &count64, sizeof(count64));
+    int fd = open(*tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && !_map_write_all(fd, header, sizeof(header)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Makes the snapshot durable and atomically moves it over path. The rename
+// itself is only durable once the directory is synced, and that has to happen
+// before the log is truncated, or a crash could keep the truncation but lose
+// the new snapshot.
+static inline MAP_STATUS _map_snapshot_commit(int fd, const char* tmp_path,
+    const char* path, bool ok)
+{
+    ok = ok && _map_fsync(fd);
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok)
+        remove(tmp_path);
+    ok = ok && _map_fsync_dir(path);
+    return ok ? MAP_SUCCESS : MAP_IO_FAILURE;
+}
+#else
+// Without MAP_ENABLE_LOG no map has a log, so the core never logs anything.
+static inline MAP_STATUS _map_log_append(map_log* log, char op,
+    const void* key, const void* value)
+{
+    (void)log;
+    (void)op;
+    (void)key;
+    (void)value;
+    return MAP_SUCCESS;
+}
+
+static inline MAP_STATUS _map_log_destroy(map_log* log)
+{
+    (void)log;
+    return MAP_SUCCESS;
+}
+#endif // MAP_ENABLE_LOG
+
 #define _map_init(map, hash_f, key_eq_f, num_bits)                             \
 do                                                                             \
 {                                                                              \
+    map._log = NULL;                                                           \
+    _map_table_init(map, hash_f, key_eq_f, num_bits);                          \
+}while(0)
+
+#define _map_table_init(map, hash_f, key_eq_f, num_bits)                       \
+do                                                                             \
+{                                                                              \
+    map._filter = NULL;                                                        \
     map._bits = num_bits;                                                      \
-    if (map._bits > MAP_BITS_PER_SIZE_T)                                       \
+    if (map._bits >= MAP_BITS_PER_SIZE_T)                                      \
     {                                                                          \
         map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
         break;                                                                 \
@@ -129,8 +812,7 @@ do                                                                             \
     map._nelem = 0;                                                            \
     map._hash_f = hash_f;                                                      \
     map._key_eq_f = key_eq_f;                                                  \
-    map._table =                                                               \
-        calloc(_map_pow2(map._bits), sizeof(map._tmp));                        \
+    map._table = _map_table_alloc(_map_pow2(map._bits), sizeof(map._tmp));     \
     if (map._table)                                                            \
         map.status = MAP_SUCCESS;                                              \
     else                                                                       \
@@ -139,9 +821,20 @@ do                                                                             \
 
 #define _map_deinit(map)                                                       \
 do                                                                             \
+{                                                                              \
+    MAP_STATUS __log_status = _map_log_destroy(map._log);                      \
+    map._log = NULL;                                                           \
+    _map_table_deinit(map);                                                    \
+    map.status = __log_status;                                                 \
+}while(0)
+
+#define _map_table_deinit(map)                                                 \
+do                                                                             \
 {                                                                              \
     free(map._table);                                                          \
     map._table = NULL;                                                         \
+    _map_filter_destroy(map._filter);                                          \
+    map._filter = NULL;                                                        \
     map.status = MAP_SUCCESS;                                                  \
 }while(0);
 
@@ -152,19 +845,51 @@ do                                                                             \
     map._tmp._key = key;                                                       \
     map._tmp._value = value;                                                   \
     map._tmp._hash = (map._hash_f)(&(map._tmp._key));                          \
+    MAP_STATUS __log_status = MAP_SUCCESS;                                     \
+    if (map._log)                                                              \
+    {                                                                          \
+        __log_status = _map_log_append(map._log, MAP_LOG_SET,                  \
+            &(map._tmp._key), &(map._tmp._value));                             \
+    }                                                                          \
+    _map_insert(map, NULL);                                                    \
+    if (__log_status != MAP_SUCCESS)                                           \
+        map.status = __log_status;                                             \
+}while(0)
+
+// Inserts the key/value pair prepared in _tmp. _tmp._hash must hold its hash.
+// If the key is already present, resolve_f(&old_value, &new_value) updates the
+// old value in place, or the new value replaces it if resolve_f is NULL.
+// Afterwards _tmp._hash holds the index the key ended up at, not a hash.
+#define _map_insert(map, resolve_f)                                            \
+do                                                                             \
+{                                                                              \
+    void (*__resolve_f)(void*, void*) = resolve_f;                             \
     map._tmp._in_use = true;                                                   \
+    /* _tmp may be swapped out below, so remember the new key's hash */        \
+    size_t __hash = map._tmp._hash;                                            \
     /* insert using robin hood insertion */                                    \
     size_t __table_len = _map_pow2(map._bits);                                 \
     size_t __curr = map._tmp._hash % __table_len;                              \
     size_t __key_not_found = true;                                             \
+    /* the new key stays in the first bucket it is swapped into */             \
+    bool __placed = false;                                                     \
+    size_t __placed_at = 0;                                                    \
     while (__key_not_found && (map._table)[__curr]._in_use)                    \
     {                                                                          \
         if (map._key_eq_f(&((map._table)[__curr]._key),                        \
             &(map._tmp._key)))                                                 \
         {                                                                      \
             /* key exists in the table already, so change it's value */        \
-            memcpy(&((map._table)[__curr]), &(map._tmp),                       \
-                sizeof(map._tmp));                                             \
+            if (__resolve_f)                                                   \
+            {                                                                  \
+                __resolve_f(&((map._table)[__curr]._value),                    \
+                    &(map._tmp._value));                                       \
+            }                                                                  \
+            else                                                               \
+            {                                                                  \
+                memcpy(&((map._table)[__curr]), &(map._tmp),                   \
+                    sizeof(map._tmp));                                         \
+            }                                                                  \
             map.status = MAP_SUCCESS;                                          \
             __key_not_found = false;                                           \
             break;                                                             \
@@ -174,6 +899,8 @@ do                                                                             \
         {                                                                      \
             _map_memswap(&(map._tmp), &((map._table)[__curr]),                 \
                 sizeof(map._tmp));                                             \
+            __placed_at = __placed ? __placed_at : __curr;                     \
+            __placed = true;                                                   \
         }                                                                      \
         __curr = (__curr + 1) % __table_len;                                   \
     }                                                                          \
@@ -184,13 +911,19 @@ do                                                                             \
             sizeof(map._tmp));                                                 \
         /* adjust map metadata */                                              \
         ++(map._nelem);                                                        \
+        if (map._filter)                                                       \
+            _map_filter_add(map._filter, __hash);                              \
         map.status = MAP_SUCCESS;                                              \
     }                                                                          \
+    /* use _hash as tmp index holder, not an actual hash */                    \
+    map._tmp._hash = __placed ? __placed_at : __curr;                          \
 }while(0)
 
 #define _map_get(ans, map, key)                                                \
 do                                                                             \
 {                                                                              \
+    /* a map_ool stores slab indices as values, use map_ool_get for it */      \
+    (void)sizeof(map._log);                                                    \
     bool __key_exists;                                                         \
     _map_key_exists(__key_exists, map, key);                                   \
     if (__key_exists)                                                          \
@@ -210,12 +943,32 @@ do                                                                             \
 do                                                                             \
 {                                                                              \
     map._tmp._key = key;                                                       \
+    _map_find(ans, map, true);                                                 \
+}while(0)
+
+// Looks up the key stored in _tmp.
+// Same as _map_key_exists, for lookups made by the library itself. These are
+// left out of the prefilter stats.
+#define _map_probe(ans, map, key)                                              \
+do                                                                             \
+{                                                                              \
+    map._tmp._key = key;                                                       \
+    _map_find(ans, map, false);                                                \
+}while(0)
+
+#define _map_find(ans, map, counted)                                           \
+do                                                                             \
+{                                                                              \
     map._tmp._hash = (map._hash_f)(&(map._tmp._key));                          \
     size_t __table_len = _map_pow2(map._bits);                                 \
     size_t __curr = map._tmp._hash % __table_len;                              \
     ans = false;                                                               \
-    while ((map._table)[__curr]._in_use &&                                     \
-        _map_dib(map._tmp._hash, __curr, map._bits) >=                         \
+    /* most misses are answered by the prefilter without touching _table */    \
+    bool __maybe_present = !map._filter ||                                     \
+        _map_filter_query(map._filter, map._tmp._hash, (counted));             \
+    /* the key can't be past a bucket whose element is closer to home */       \
+    while (__maybe_present && (map._table)[__curr]._in_use &&                  \
+        _map_dib(map._tmp._hash, __curr, map._bits) <=                         \
         _map_dib((map._table)[__curr]._hash, __curr, map._bits))               \
     {                                                                          \
         if (map._key_eq_f(&((map._table)[__curr]._key),                        \
@@ -231,6 +984,8 @@ do                                                                             \
         }                                                                      \
         __curr = (__curr + 1) % __table_len;                                   \
     }                                                                          \
+    if (map._filter && __maybe_present && !ans)                                \
+        map._filter->stats.false_positives += (counted);                       \
     map.status = MAP_SUCCESS;                                                  \
 }while(0)
 
@@ -241,32 +996,15 @@ do                                                                             \
     _map_key_exists(__key_exists, map, key);                                   \
     if (__key_exists)                                                          \
     {                                                                          \
-        /* _map_key_exists stores the index where target element was found */  \
-        /* Note: _tmp._hash isn't actually a hash. It's the index where the */ \
-        /* target element actually ended up. */                                \
-        size_t __table_len = _map_pow2(map._bits);                             \
-        size_t __target_pos = map._tmp._hash;                                  \
-        size_t __stop_pos = (__target_pos + 1) % __table_len;                  \
-        /* find position of the stop bucket */                                 \
-        while ((map._table)[__stop_pos]._in_use &&                             \
-            _map_dib(__target_pos, __stop_pos, map._bits) > 0)                 \
+        MAP_STATUS __log_status = MAP_SUCCESS;                                 \
+        if (map._log)                                                          \
         {                                                                      \
-            __stop_pos = (__stop_pos + 1) % __table_len;                       \
+            __log_status = _map_log_append(map._log, MAP_LOG_REMOVE,           \
+                &(map._tmp._key), NULL);                                       \
         }                                                                      \
-        /* shift all elements in front of the stop bucket */                   \
-        size_t __i = __target_pos;                                             \
-        while (__i != __stop_pos-1)                                            \
-        {                                                                      \
-            memmove(&((map._table)[__i]),                                      \
-                &((map._table)[(__i + 1) % __table_len]),                      \
-                sizeof(map._tmp));                                             \
-            __i = (__i + 1) % __table_len;                                     \
-        }                                                                      \
-        /* mark the duplicate bucket at the back as no longer in use */        \
-        (map._table)[__stop_pos-1]._in_use = false;                            \
-        /* adjust map metadata */                                              \
-        --(map._nelem);                                                        \
-        map.status = MAP_SUCCESS;                                              \
+        _map_backshift(map);                                                   \
+        if (__log_status != MAP_SUCCESS)                                       \
+            map.status = __log_status;                                         \
     }                                                                          \
     else                                                                       \
     {                                                                          \
@@ -274,39 +1012,1288 @@ do                                                                             \
     }                                                                          \
 }while(0)
 
-#define _map_length(ans, map)                                                  \
+#define _map_backshift(map)                                                    \
 do                                                                             \
 {                                                                              \
-    ans = map._nelem;                                                          \
+    /* _map_key_exists stores the index where target element was found */      \
+    /* Note: _tmp._hash isn't actually a hash. It's the index where the */     \
+    /* target element actually ended up. */                                    \
+    size_t __table_len = _map_pow2(map._bits);                                 \
+    size_t __target_pos = map._tmp._hash;                                      \
+    if (map._filter)                                                           \
+        _map_filter_remove(map._filter, (map._table)[__target_pos]._hash);     \
+    size_t __stop_pos = (__target_pos + 1) % __table_len;                      \
+    /* find position of the stop bucket, i.e. the first bucket that is */      \
+    /* either empty or holds an element already in its home bucket */          \
+    while ((map._table)[__stop_pos]._in_use &&                                 \
+        _map_dib((map._table)[__stop_pos]._hash, __stop_pos, map._bits) > 0)   \
+    {                                                                          \
+        __stop_pos = (__stop_pos + 1) % __table_len;                           \
+    }                                                                          \
+    /* shift all elements in front of the stop bucket */                       \
+    size_t __last_pos = (__stop_pos + __table_len - 1) % __table_len;          \
+    size_t __i = __target_pos;                                                 \
+    while (__i != __last_pos)                                                  \
+    {                                                                          \
+        memmove(&((map._table)[__i]),                                          \
+            &((map._table)[(__i + 1) % __table_len]),                          \
+            sizeof(map._tmp));                                                 \
+        __i = (__i + 1) % __table_len;                                         \
+    }                                                                          \
+    /* mark the duplicate bucket at the back as no longer in use */            \
+    (map._table)[__last_pos]._in_use = false;                                  \
+    /* adjust map metadata */                                                  \
+    --(map._nelem);                                                            \
     map.status = MAP_SUCCESS;                                                  \
 }while(0)
 
-#define _map_load_factor(ans, map)                                             \
+#define _map_filter_enable(map, fp_rate)                                       \
 do                                                                             \
 {                                                                              \
-    ans = ((double)map._nelem)/_map_pow2(map._bits);                           \
+    double __fp_rate = (fp_rate);                                              \
+    if (!(__fp_rate > 0 && __fp_rate < 1))                                     \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    map_filter* __filter;                                                      \
+    size_t __table_len = _map_pow2(map._bits);                                 \
+    map.status = _map_filter_create(&__filter, __table_len, __fp_rate);        \
+    if (map.status != MAP_SUCCESS)                                             \
+        break;                                                                 \
+    /* fill the new filter from the stored hashes of the current keys */       \
+    for (size_t __i = 0; __i < __table_len; ++__i)                             \
+    {                                                                          \
+        if ((map._table)[__i]._in_use)                                         \
+            _map_filter_add(__filter, (map._table)[__i]._hash);                \
+    }                                                                          \
+    _map_filter_destroy(map._filter);                                          \
+    map._filter = __filter;                                                    \
+}while(0)
+
+#define _map_filter_disable(map)                                               \
+do                                                                             \
+{                                                                              \
+    _map_filter_destroy(map._filter);                                          \
+    map._filter = NULL;                                                        \
     map.status = MAP_SUCCESS;                                                  \
 }while(0)
 
-#define _map_keys(ans, map)                                                    \
+#define _map_filter_stats(ans, map)                                            \
 do                                                                             \
 {                                                                              \
-    size_t __ans_index = 0;                                                    \
-    size_t __map_index = 0;                                                    \
-    size_t __elems_to_copy;                                                    \
-    map_length(__elems_to_copy, map);                                          \
-    while (__elems_to_copy)                                                    \
+    memset(&(ans), 0, sizeof(ans));                                            \
+    if (map._filter)                                                           \
     {                                                                          \
-        if (map._table[__map_index]._in_use)                                   \
-        {                                                                      \
-            ans[__ans_index++] = map._table[__map_index]._key;                 \
-            __elems_to_copy--;                                                 \
-        }                                                                      \
-        __map_index++;                                                         \
+        ans = map._filter->stats;                                              \
+        if (ans.queries)                                                       \
+            ans.hit_rate = (double)ans.negatives / ans.queries;                \
     }                                                                          \
     map.status = MAP_SUCCESS;                                                  \
 }while(0)
 
+#ifdef MAP_ENABLE_LOG
+#define _map_log_open(map, path, batch)                                        \
+do                                                                             \
+{                                                                              \
+    if (map._log)                                                              \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    map.status = _map_log_create(&map._log, path, sizeof(map._tmp._key),       \
+        sizeof(map._tmp._value), batch);                                       \
+}while(0)
+
+#define _map_log_sync(map)                                                     \
+do                                                                             \
+{                                                                              \
+    map.status = map._log ? _map_log_commit(map._log) : MAP_SUCCESS;           \
+}while(0)
+
+#define _map_log_close(map)                                                    \
+do                                                                             \
+{                                                                              \
+    map.status = _map_log_destroy(map._log);                                   \
+    map._log = NULL;                                                           \
+}while(0)
+
+#define _map_log_compact(map, snapshot_path)                                   \
+do                                                                             \
+{                                                                              \
+    if (!map._log)                                                             \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    /* a failed log has lost records, but the snapshot of the map holds */     \
+    /* them all, so compacting is how a failed log recovers */                 \
+    map.status = map._log->failed ? MAP_SUCCESS : _map_log_commit(map._log);   \
+    if (map.status != MAP_SUCCESS)                                             \
+        break;                                                                 \
+    size_t __key_size = sizeof(map._tmp._key);                                 \
+    size_t __record_size = __key_size + sizeof(map._tmp._value);               \
+    char* __tmp_path = NULL;                                                   \
+    char* __chunk = malloc(MAP_SNAPSHOT_CHUNK * __record_size);                \
+    int __fd = __chunk ? _map_snapshot_open(snapshot_path, &__tmp_path,        \
+        __key_size, sizeof(map._tmp._value), map._nelem) : -1;                 \
+    if (__fd < 0)                                                              \
+    {                                                                          \
+        map.status = __chunk && __tmp_path ?                                   \
+            MAP_IO_FAILURE : MAP_ALLOC_FAILURE;                                \
+        free(__chunk);                                                         \
+        free(__tmp_path);                                                      \
+        break;                                                                 \
+    }                                                                          \
+    /* write every key/value pair, MAP_SNAPSHOT_CHUNK records at a time */     \
+    bool __ok = true;                                                          \
+    size_t __in_chunk = 0;                                                     \
+    size_t __table_len = _map_pow2(map._bits);                                 \
+    for (size_t __i = 0; __ok && __i < __table_len; ++__i)                     \
+    {                                                                          \
+        if (!(map._table)[__i]._in_use)                                        \
+            continue;                                                          \
+        char* __record = __chunk + __in_chunk * __record_size;                 \
+        memcpy(__record, &((map._table)[__i]._key), __key_size);               \
+        memcpy(__record + __key_size, &((map._table)[__i]._value),             \
+            sizeof(map._tmp._value));                                          \
+        if (++__in_chunk == MAP_SNAPSHOT_CHUNK)                                \
+        {                                                                      \
+            __ok = _map_write_all(__fd, __chunk, __in_chunk * __record_size);  \
+            __in_chunk = 0;                                                    \
+        }                                                                      \
+    }                                                                          \
+    __ok = __ok && _map_write_all(__fd, __chunk, __in_chunk * __record_size);  \
+    map.status = _map_snapshot_commit(__fd, __tmp_path, snapshot_path, __ok);  \
+    /* replaying the old log on top of the new snapshot would be harmless, */  \
+    /* so a crash before the truncation below loses nothing */                 \
+    if (map.status == MAP_SUCCESS)                                             \
+        map.status = _map_log_truncate(map._log);                              \
+    free(__chunk);                                                             \
+    free(__tmp_path);                                                          \
+}while(0)
+
+// Sets the key/value pair read into _tmp. A full table only takes updates,
+// since inserting a new key into it would never find an empty bucket.
+#define _map_replay_set(map)                                                   \
+do                                                                             \
+{                                                                              \
+    if (map._nelem < _map_pow2(map._bits))                                     \
+    {                                                                          \
+        map._tmp._hash = (map._hash_f)(&(map._tmp._key));                      \
+        _map_insert(map, NULL);                                                \
+        break;                                                                 \
+    }                                                                          \
+    /* _map_find overwrites _tmp._value, so keep the new one aside */          \
+    char __value[sizeof(map._tmp._value)];                                     \
+    memcpy(__value, &(map._tmp._value), sizeof(__value));                      \
+    bool __key_exists;                                                         \
+    _map_find(__key_exists, map, false);                                       \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        memcpy(&((map._table)[map._tmp._hash]._value), __value,                \
+            sizeof(__value));                                                  \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+    }                                                                          \
+}while(0)
+
+#define _map_log_replay(map, snapshot_path, log_path)                          \
+do                                                                             \
+{                                                                              \
+    /* replayed operations must not be logged again */                         \
+    if (map._log)                                                              \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    map.status = MAP_SUCCESS;                                                  \
+    bool __empty;                                                              \
+    FILE* __file = fopen(snapshot_path, "rb");                                 \
+    if (__file)                                                                \
+    {                                                                          \
+        uint64_t __count = 0;                                                  \
+        map.status = _map_log_read_header(__file, MAP_SNAPSHOT_MAGIC,          \
+            sizeof(map._tmp._key), sizeof(map._tmp._value), &__empty);         \
+        if (map.status == MAP_SUCCESS && !__empty &&                           \
+            fread(&__count, sizeof(__count), 1, __file) != 1)                  \
+        {                                                                      \
+            map.status = MAP_IO_FAILURE;                                       \
+        }                                                                      \
+        /* the keys are distinct, so more of them than buckets can't fit */    \
+        if (map.status == MAP_SUCCESS && __count > _map_pow2(map._bits))       \
+        {                                                                      \
+            map.status = MAP_INPUT_OUT_OF_RANGE;                               \
+        }                                                                      \
+        for (uint64_t __i = 0; map.status == MAP_SUCCESS && __i < __count;     \
+            ++__i)                                                             \
+        {                                                                      \
+            if (fread(&(map._tmp._key), sizeof(map._tmp._key), 1, __file)      \
+                != 1 || fread(&(map._tmp._value), sizeof(map._tmp._value), 1,  \
+                __file) != 1)                                                  \
+            {                                                                  \
+                map.status = MAP_IO_FAILURE;                                   \
+                break;                                                         \
+            }                                                                  \
+            _map_replay_set(map);                                              \
+        }                                                                      \
+        fclose(__file);                                                        \
+    }                                                                          \
+    if (map.status != MAP_SUCCESS)                                             \
+        break;                                                                 \
+    __file = fopen(log_path, "rb");                                            \
+    if (!__file)                                                               \
+        break;                                                                 \
+    map.status = _map_log_read_header(__file, MAP_LOG_MAGIC,                   \
+        sizeof(map._tmp._key), sizeof(map._tmp._value), &__empty);             \
+    char __op;                                                                 \
+    /* a record cut short by a crash ends the replay */                        \
+    while (map.status == MAP_SUCCESS && !__empty &&                            \
+        fread(&__op, 1, 1, __file) == 1 &&                                     \
+        fread(&(map._tmp._key), sizeof(map._tmp._key), 1, __file) == 1 &&      \
+        fread(&(map._tmp._value), sizeof(map._tmp._value), 1, __file) == 1)    \
+    {                                                                          \
+        if (__op == MAP_LOG_SET)                                               \
+        {                                                                      \
+            _map_replay_set(map);                                              \
+        }                                                                      \
+        else if (__op == MAP_LOG_REMOVE)                                       \
+        {                                                                      \
+            bool __key_exists;                                                 \
+            _map_find(__key_exists, map, false);                               \
+            if (__key_exists)                                                  \
+                _map_backshift(map);                                           \
+        }                                                                      \
+        else                                                                   \
+        {                                                                      \
+            map.status = MAP_IO_FAILURE;                                       \
+        }                                                                      \
+    }                                                                          \
+    fclose(__file);                                                            \
+}while(0)
+#endif // MAP_ENABLE_LOG
+
+#define MAP_MERGE_MAX_LOAD 0.875
+
+typedef struct
+{
+    size_t home;  /* home bucket in the destination table */
+    size_t hash;
+    size_t index; /* position in the source table */
+} _map_merge_entry;
+
+static inline int _map_merge_entry_cmp(const void* a, const void* b)
+{
+    size_t home_a = ((const _map_merge_entry*)a)->home;
+    size_t home_b = ((const _map_merge_entry*)b)->home;
+    return (home_a > home_b) - (home_a < home_b);
+}
+
+// Moves every element into a new table of 2^new_bits slots using the stored
+// hashes. A prefilter is resized to match, keeping its hash count.
+#define _map_rehash(map, new_bits)                                             \
+do                                                                             \
+{                                                                              \
+    size_t __old_len = _map_pow2(map._bits);                                   \
+    size_t __new_len = _map_pow2(new_bits);                                    \
+    char* __old_table = (char*)map._table;                                     \
+    void* __new_table = _map_table_alloc(__new_len, sizeof(map._tmp));         \
+    if (!__new_table)                                                          \
+    {                                                                          \
+        map.status = MAP_ALLOC_FAILURE;                                        \
+        break;                                                                 \
+    }                                                                          \
+    /* the filter already holds every key, so keep it out of the reinsert */   \
+    map_filter* __filter = map._filter;                                        \
+    map._filter = NULL;                                                        \
+    map._table = __new_table;                                                  \
+    map._bits = new_bits;                                                      \
+    map._nelem = 0;                                                            \
+    for (size_t __i = 0; __i < __old_len; ++__i)                               \
+    {                                                                          \
+        memcpy(&(map._tmp), __old_table + __i*sizeof(map._tmp),                \
+            sizeof(map._tmp));                                                 \
+        if (map._tmp._in_use)                                                  \
+            _map_insert(map, NULL);                                            \
+    }                                                                          \
+    free(__old_table);                                                         \
+    map._filter = __filter;                                                    \
+    map_filter* __resized;                                                     \
+    if (__filter && _map_filter_create(&__resized, __new_len,                  \
+        1.0 / _map_pow2(__filter->nhashes)) == MAP_SUCCESS)                    \
+    {                                                                          \
+        for (size_t __i = 0; __i < __new_len; ++__i)                           \
+        {                                                                      \
+            if ((map._table)[__i]._in_use)                                     \
+                _map_filter_add(__resized, (map._table)[__i]._hash);           \
+        }                                                                      \
+        __resized->stats = __filter->stats;                                    \
+        _map_filter_destroy(__filter);                                         \
+        map._filter = __resized;                                               \
+    }                                                                          \
+    map.status = MAP_SUCCESS;                                                  \
+}while(0)
+
+#define _map_merge(dst, src, conflict_f)                                       \
+do                                                                             \
+{                                                                              \
+    /* grow dst once up front rather than letting the merge fill it */         \
+    unsigned __bits = dst._bits;                                               \
+    while ((double)(dst._nelem + src._nelem) >                                 \
+        MAP_MERGE_MAX_LOAD * _map_pow2(__bits) &&                              \
+        __bits + 1 < MAP_BITS_PER_SIZE_T)                                      \
+    {                                                                          \
+        ++__bits;                                                              \
+    }                                                                          \
+    if (__bits != dst._bits)                                                   \
+    {                                                                          \
+        _map_rehash(dst, __bits);                                              \
+        if (dst.status != MAP_SUCCESS)                                         \
+            break;                                                             \
+    }                                                                          \
+    /* inserting in home bucket order appends to the end of each cluster */    \
+    /* instead of displacing elements. Same sized tables with the same */      \
+    /* hash function are already in that order. */                             \
+    size_t __dst_len = _map_pow2(dst._bits);                                   \
+    size_t __src_len = _map_pow2(src._bits);                                   \
+    size_t __n = src._nelem;                                                   \
+    bool __same_hash = dst._hash_f == src._hash_f;                             \
+    _map_merge_entry* __order = NULL;                                          \
+    if (dst._bits != src._bits || !__same_hash)                                \
+    {                                                                          \
+        __order = malloc(__n * sizeof(_map_merge_entry) + 1);                  \
+        if (!__order)                                                          \
+        {                                                                      \
+            dst.status = MAP_ALLOC_FAILURE;                                    \
+            break;                                                             \
+        }                                                                      \
+        size_t __k = 0;                                                        \
+        for (size_t __i = 0; __i < __src_len; ++__i)                           \
+        {                                                                      \
+            if (!(src._table)[__i]._in_use)                                    \
+                continue;                                                      \
+            __order[__k].hash = __same_hash ? (src._table)[__i]._hash :        \
+                (dst._hash_f)(&((src._table)[__i]._key));                      \
+            __order[__k].home = __order[__k].hash % __dst_len;                 \
+            __order[__k].index = __i;                                          \
+            ++__k;                                                             \
+        }                                                                      \
+        qsort(__order, __n, sizeof(_map_merge_entry), _map_merge_entry_cmp);   \
+    }                                                                          \
+    MAP_STATUS __log_status = MAP_SUCCESS;                                     \
+    size_t __i = 0;                                                            \
+    for (size_t __k = 0; __k < __n; ++__k)                                     \
+    {                                                                          \
+        size_t __pos;                                                          \
+        if (__order)                                                           \
+        {                                                                      \
+            __pos = __order[__k].index;                                        \
+            dst._tmp._hash = __order[__k].hash;                                \
+        }                                                                      \
+        else                                                                   \
+        {                                                                      \
+            while (!(src._table)[__i]._in_use)                                 \
+                ++__i;                                                         \
+            __pos = __i++;                                                     \
+            dst._tmp._hash = (src._table)[__pos]._hash;                        \
+        }                                                                      \
+        dst._tmp._key = (src._table)[__pos]._key;                              \
+        dst._tmp._value = (src._table)[__pos]._value;                          \
+        _map_insert(dst, conflict_f);                                          \
+        if (dst._log)                                                          \
+        {                                                                      \
+            /* log the value the key ended up with, from where it landed */    \
+            size_t __at = dst._tmp._hash;                                      \
+            MAP_STATUS __status = _map_log_append(dst._log, MAP_LOG_SET,       \
+                &((dst._table)[__at]._key), &((dst._table)[__at]._value));     \
+            if (__status != MAP_SUCCESS)                                       \
+                __log_status = __status;                                       \
+        }                                                                      \
+    }                                                                          \
+    free(__order);                                                             \
+    dst.status = __log_status;                                                 \
+}while(0)
+
+#define _map_length(ans, map)                                                  \
+do                                                                             \
+{                                                                              \
+    ans = map._nelem;                                                          \
+    map.status = MAP_SUCCESS;                                                  \
+}while(0)
+
+#define _map_load_factor(ans, map)                                             \
+do                                                                             \
+{                                                                              \
+    ans = ((double)map._nelem)/_map_pow2(map._bits);                           \
+    map.status = MAP_SUCCESS;                                                  \
+}while(0)
+
+#define _map_keys(ans, map)                                                    \
+do                                                                             \
+{                                                                              \
+    size_t __ans_index = 0;                                                    \
+    size_t __map_index = 0;                                                    \
+    size_t __elems_to_copy;                                                    \
+    map_length(__elems_to_copy, map);                                          \
+    while (__elems_to_copy)                                                    \
+    {                                                                          \
+        if (map._table[__map_index]._in_use)                                   \
+        {                                                                      \
+            ans[__ans_index++] = map._table[__map_index]._key;                 \
+            __elems_to_copy--;                                                 \
+        }                                                                      \
+        __map_index++;                                                         \
+    }                                                                          \
+    map.status = MAP_SUCCESS;                                                  \
+}while(0)
+
+#ifdef MAP_ENABLE_PARALLEL
+typedef struct
+{
+    char* table;
+    size_t elem_size;
+    size_t key_offset;
+    size_t value_offset;
+    size_t in_use_offset;
+    char* slab;   /* map_ool value slab, NULL for maps with inline values */
+    size_t slab_elem_size;
+    size_t slab_value_offset;
+    size_t begin; /* first index of the range walked by this job */
+    size_t end;   /* one past the last index of the range */
+    void (*fn)(void*, void*, void*);
+    void* ctx;
+} _map_par_job;
+
+static inline size_t _map_gcd(size_t a, size_t b)
+{
+    while (b)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static inline void* _map_par_worker(void* arg)
+{
+    _map_par_job* job = (_map_par_job*)arg;
+    for (size_t i = job->begin; i < job->end; ++i)
+    {
+        char* elem = job->table + i*job->elem_size;
+        if (*(bool*)(elem + job->in_use_offset))
+        {
+            char* value = elem + job->value_offset;
+            if (job->slab)
+            {
+                value = job->slab + *(uint32_t*)value*job->slab_elem_size +
+                    job->slab_value_offset;
+            }
+            job->fn(elem + job->key_offset, value, job->ctx);
+        }
+    }
+    return NULL;
+}
+
+// Splits [0, table_len) into nthreads ranges and runs proto->fn over each.
+// Job t gets ctxs + t*ctx_stride as its context, or proto->ctx if ctx_stride
+// is 0. The calling thread handles the first range itself, and any range
+// whose thread cannot be started is run on the calling thread as well.
+static inline MAP_STATUS _map_par_run(_map_par_job* proto, size_t table_len,
+    unsigned nthreads, char* ctxs, size_t ctx_stride)
+{
+    _map_par_job* jobs = calloc(nthreads, sizeof(_map_par_job));
+    pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+    bool* started = calloc(nthreads, sizeof(bool));
+    if (!jobs || !threads || !started)
+    {
+        free(jobs);
+        free(threads);
+        free(started);
+        return MAP_ALLOC_FAILURE;
+    }
+
+    /* round ranges up to a whole number of cache lines worth of elements */
+    size_t line_elems = MAP_CACHE_LINE / _map_gcd(proto->elem_size,
+        MAP_CACHE_LINE);
+    size_t chunk = (table_len + nthreads - 1) / nthreads;
+    chunk = (chunk + line_elems - 1) / line_elems * line_elems;
+
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        jobs[t] = *proto;
+        jobs[t].begin = t*chunk < table_len ? t*chunk : table_len;
+        jobs[t].end = jobs[t].begin + chunk < table_len ?
+            jobs[t].begin + chunk : table_len;
+        if (ctx_stride)
+            jobs[t].ctx = ctxs + t*ctx_stride;
+        if (t > 0 && jobs[t].begin < jobs[t].end)
+        {
+            started[t] = pthread_create(&threads[t], NULL, _map_par_worker,
+                &jobs[t]) == 0;
+        }
+    }
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        if (!started[t])
+            _map_par_worker(&jobs[t]);
+    }
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+
+    free(jobs);
+    free(threads);
+    free(started);
+    return MAP_SUCCESS;
+}
+
+#define _map_par_job_init(job, map, func, context)                             \
+do                                                                             \
+{                                                                              \
+    job.table = (char*)map._table;                                             \
+    job.elem_size = sizeof(map._tmp);                                          \
+    job.key_offset = (size_t)((char*)&(map._tmp._key) - (char*)&(map._tmp));   \
+    job.value_offset =                                                         \
+        (size_t)((char*)&(map._tmp._value) - (char*)&(map._tmp));              \
+    job.in_use_offset =                                                        \
+        (size_t)((char*)&(map._tmp._in_use) - (char*)&(map._tmp));             \
+    job.slab = NULL;                                                           \
+    job.slab_elem_size = 0;                                                    \
+    job.slab_value_offset = 0;                                                 \
+    job.begin = 0;                                                             \
+    job.end = 0;                                                               \
+    job.fn = func;                                                             \
+    job.ctx = context;                                                         \
+}while(0)
+
+#define _map_ool_par_job_init(job, map, func, context)                         \
+do                                                                             \
+{                                                                              \
+    _map_par_job_init(job, map, func, context);                                \
+    job.slab = (char*)map._slab;                                               \
+    job.slab_elem_size = sizeof(*map._slab);                                   \
+    job.slab_value_offset =                                                    \
+        (size_t)((char*)&(map._slab->_value) - (char*)map._slab);              \
+}while(0)
+
+// The table of a map_ool holds slab indices rather than values, so the plain
+// versions refuse to compile for one (a map_ool has no _log member).
+#define _map_parallel_for(map, fn, ctx, nthreads)                              \
+do                                                                             \
+{                                                                              \
+    (void)sizeof(map._log);                                                    \
+    _map_par_job __proto;                                                      \
+    _map_par_job_init(__proto, map, fn, ctx);                                  \
+    _map_par_for(__proto, map, nthreads);                                      \
+}while(0)
+
+#define _map_ool_parallel_for(map, fn, ctx, nthreads)                          \
+do                                                                             \
+{                                                                              \
+    _map_par_job __proto;                                                      \
+    _map_ool_par_job_init(__proto, map, fn, ctx);                              \
+    _map_par_for(__proto, map, nthreads);                                      \
+}while(0)
+
+#define _map_parallel_reduce(ans, map, fold_f, combine_f, nthreads)            \
+do                                                                             \
+{                                                                              \
+    (void)sizeof(map._log);                                                    \
+    _map_par_job __proto;                                                      \
+    _map_par_job_init(__proto, map, fold_f, NULL);                             \
+    _map_par_reduce(ans, __proto, map, combine_f, nthreads);                   \
+}while(0)
+
+#define _map_ool_parallel_reduce(ans, map, fold_f, combine_f, nthreads)        \
+do                                                                             \
+{                                                                              \
+    _map_par_job __proto;                                                      \
+    _map_ool_par_job_init(__proto, map, fold_f, NULL);                         \
+    _map_par_reduce(ans, __proto, map, combine_f, nthreads);                   \
+}while(0)
+
+#define _map_par_for(proto, map, nthreads)                                     \
+do                                                                             \
+{                                                                              \
+    if ((nthreads) == 0)                                                       \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    map.status = _map_par_run(&(proto), _map_pow2(map._bits), (nthreads),      \
+        NULL, 0);                                                              \
+}while(0)
+
+#define _map_par_reduce(ans, proto, map, combine_f, nthreads)                  \
+do                                                                             \
+{                                                                              \
+    unsigned __nthreads = (nthreads);                                          \
+    if (__nthreads == 0)                                                       \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    /* every thread folds into its own copy of ans, each on its own line */    \
+    size_t __stride = (sizeof(ans) + MAP_CACHE_LINE - 1) / MAP_CACHE_LINE      \
+        * MAP_CACHE_LINE;                                                      \
+    char* __partials = aligned_alloc(MAP_CACHE_LINE, __nthreads * __stride);   \
+    if (!__partials)                                                           \
+    {                                                                          \
+        map.status = MAP_ALLOC_FAILURE;                                        \
+        break;                                                                 \
+    }                                                                          \
+    for (unsigned __t = 0; __t < __nthreads; ++__t)                            \
+        memcpy(__partials + __t*__stride, &(ans), sizeof(ans));                \
+    map.status = _map_par_run(&(proto), _map_pow2(map._bits), __nthreads,      \
+        __partials, __stride);                                                 \
+    if (map.status == MAP_SUCCESS)                                             \
+    {                                                                          \
+        void (*__combine_f)(void*, void*) = combine_f;                         \
+        memcpy(&(ans), __partials, sizeof(ans));                               \
+        for (unsigned __t = 1; __t < __nthreads; ++__t)                        \
+            __combine_f(&(ans), __partials + __t*__stride);                    \
+    }                                                                          \
+    free(__partials);                                                          \
+}while(0)
+#endif // MAP_ENABLE_PARALLEL
+
+#define MAP_SLAB_NIL UINT32_MAX
+#define MAP_OOL_MAX_BITS 31 /* slab indices and MAP_SLAB_NIL fit in uint32_t */
+
+#define _map_ool_init(map, hash_f, key_eq_f, num_bits)                         \
+do                                                                             \
+{                                                                              \
+    map._slab = NULL;                                                          \
+    map._slab_top = 0;                                                         \
+    map._free_head = MAP_SLAB_NIL;                                             \
+    if ((num_bits) > MAP_OOL_MAX_BITS)                                         \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    _map_table_init(map, hash_f, key_eq_f, num_bits);                          \
+    if (map.status != MAP_SUCCESS)                                             \
+        break;                                                                 \
+    /* the slab is sized to the table up front so values never move */         \
+    map._slab = calloc(_map_pow2(map._bits), sizeof(*map._slab));              \
+    if (!map._slab)                                                            \
+    {                                                                          \
+        free(map._table);                                                      \
+        map._table = NULL;                                                     \
+        map.status = MAP_ALLOC_FAILURE;                                        \
+    }                                                                          \
+}while(0)
+
+#define _map_ool_deinit(map)                                                   \
+do                                                                             \
+{                                                                              \
+    free(map._slab);                                                           \
+    map._slab = NULL;                                                          \
+    _map_table_deinit(map);                                                    \
+}while(0)
+
+#define _map_ool_set(map, key, value)                                          \
+do                                                                             \
+{                                                                              \
+    bool __key_exists;                                                         \
+    _map_probe(__key_exists, map, key);                                        \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        /* _map_probe stores the slab index, so overwrite in place */          \
+        map._slab[map._tmp._value]._value = value;                             \
+        map.status = MAP_SUCCESS;                                              \
+        break;                                                                 \
+    }                                                                          \
+    if (map._nelem == _map_pow2(map._bits))                                    \
+    {                                                                          \
+        map.status = MAP_INPUT_OUT_OF_RANGE;                                   \
+        break;                                                                 \
+    }                                                                          \
+    /* take a slot off the free list, or the next never used slot */           \
+    uint32_t __slot;                                                           \
+    if (map._free_head != MAP_SLAB_NIL)                                        \
+    {                                                                          \
+        __slot = map._free_head;                                               \
+        map._free_head = map._slab[__slot]._next_free;                         \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        __slot = map._slab_top++;                                              \
+    }                                                                          \
+    map._slab[__slot]._value = value;                                          \
+    map._slab[__slot]._in_use = true;                                          \
+    /* _map_key_exists left the key in _tmp, so key is only evaluated once */  \
+    map._tmp._value = __slot;                                                  \
+    map._tmp._hash = (map._hash_f)(&(map._tmp._key));                          \
+    _map_insert(map, NULL);                                                    \
+}while(0)
+
+#define _map_ool_get(ans, map, key)                                            \
+do                                                                             \
+{                                                                              \
+    bool __key_exists;                                                         \
+    _map_key_exists(__key_exists, map, key);                                   \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        ans = map._slab[map._tmp._value]._value;                               \
+        map.status = MAP_SUCCESS;                                              \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        memset(&ans, 0, sizeof(ans)); /* to shut clang up */                   \
+        map.status = MAP_KEY_NOT_FOUND;                                        \
+    }                                                                          \
+}while(0)
+
+#define _map_ool_ref(ans, map, key)                                            \
+do                                                                             \
+{                                                                              \
+    bool __key_exists;                                                         \
+    _map_key_exists(__key_exists, map, key);                                   \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        ans = &(map._slab[map._tmp._value]._value);                            \
+        map.status = MAP_SUCCESS;                                              \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        ans = NULL;                                                            \
+        map.status = MAP_KEY_NOT_FOUND;                                        \
+    }                                                                          \
+}while(0)
+
+#define _map_ool_remove(map, key)                                              \
+do                                                                             \
+{                                                                              \
+    bool __key_exists;                                                         \
+    _map_key_exists(__key_exists, map, key);                                   \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        /* return the value's slot to the free list */                         \
+        uint32_t __slot = map._tmp._value;                                     \
+        map._slab[__slot]._in_use = false;                                     \
+        map._slab[__slot]._next_free = map._free_head;                         \
+        map._free_head = __slot;                                               \
+        _map_backshift(map);                                                   \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        map.status = MAP_KEY_NOT_FOUND;                                        \
+    }                                                                          \
+}while(0)
+
+#define _map_ool_values(ans, map)                                              \
+do                                                                             \
+{                                                                              \
+    /* linear scan of the slab, which is dense below _slab_top */              \
+    size_t __ans_index = 0;                                                    \
+    for (uint32_t __i = 0; __i < map._slab_top; ++__i)                         \
+    {                                                                          \
+        if (map._slab[__i]._in_use)                                            \
+            ans[__ans_index++] = map._slab[__i]._value;                        \
+    }                                                                          \
+    map.status = MAP_SUCCESS;                                                  \
+}while(0)
+
+#define MAP_MPH_BUCKET_SIZE 3 /* average number of keys per bucket */
+#define MAP_MPH_SLACK 50 /* one spare slot per this many keys, a load of 0.98 */
+#define MAP_MPH_MAX_PILOT (1u << 20) /* pilots tried before reseeding */
+#define MAP_MPH_MAX_SEEDS 16
+#define MAP_FROZEN_MAGIC "GCMF"
+#define MAP_FROZEN_VERSION 2
+
+static inline size_t _map_mph_nbuckets(size_t nkeys)
+{
+    return nkeys / MAP_MPH_BUCKET_SIZE + 1;
+}
+
+static inline size_t _map_mph_nslots(size_t nkeys)
+{
+    return nkeys + nkeys / MAP_MPH_SLACK + 1;
+}
+
+static inline uint64_t _map_mph_pilot_hash(uint32_t pilot)
+{
+    return _map_mix((uint64_t)pilot + 1);
+}
+
+static inline size_t _map_mph_slot(uint64_t mixed_hash, uint64_t pilot_hash,
+    size_t nslots)
+{
+    return (size_t)(_map_mix(mixed_hash ^ pilot_hash) % nslots);
+}
+
+// Returns the position in [0, nkeys) of a hash the perfect hash was built
+// over, or an arbitrary position in that range for any other hash.
+static inline size_t _map_mph_lookup(const map_mph* mph, size_t hash)
+{
+    uint64_t mixed_hash = _map_mix((uint64_t)hash ^ mph->seed);
+    size_t slot = _map_mph_slot(mixed_hash,
+        _map_mph_pilot_hash(mph->pilots[mixed_hash % mph->nbuckets]),
+        mph->nslots);
+    return slot < mph->nkeys ? slot : mph->remap[slot - mph->nkeys];
+}
+
+static inline void _map_mph_destroy(map_mph* mph)
+{
+    free(mph->pilots);
+    free(mph->remap);
+    mph->pilots = NULL;
+    mph->remap = NULL;
+}
+
+// Builds a minimal perfect hash over n distinct hashes with the hash and
+// displace method: keys are grouped into buckets, and buckets are placed
+// largest first by searching for a pilot value that sends every key in the
+// bucket to a free slot. Pilots search a few more slots than there are keys,
+// which keeps the search for the last buckets short, and the keys that land
+// past n are then remapped to the slots below n that were left free. Returns
+// MAP_INPUT_OUT_OF_RANGE if two of the hashes are equal.
+static inline MAP_STATUS _map_mph_build(const size_t* hashes, size_t n,
+    map_mph* mph)
+{
+    size_t nb = _map_mph_nbuckets(n);
+    size_t ns = _map_mph_nslots(n);
+    uint64_t* mixed = malloc((n + 1) * sizeof(uint64_t));
+    size_t* bucket_start = calloc(nb + 2, sizeof(size_t));
+    size_t* by_bucket = malloc((n + 1) * sizeof(size_t));
+    size_t* size_start = calloc(n + 2, sizeof(size_t));
+    size_t* by_size = malloc(nb * sizeof(size_t));
+    size_t* trial = malloc((n + 1) * sizeof(size_t));
+    /* a bit per slot keeps the randomly probed set small enough to cache */
+    uint64_t* taken = malloc((ns / 64 + 1) * sizeof(uint64_t));
+    uint32_t* p = calloc(nb, sizeof(uint32_t));
+    size_t* remap = calloc(ns - n, sizeof(size_t));
+    MAP_STATUS status = MAP_ALLOC_FAILURE;
+    if (!mixed || !bucket_start || !by_bucket || !size_start || !by_size ||
+        !trial || !taken || !p || !remap)
+    {
+        goto done;
+    }
+
+    status = MAP_FREEZE_FAILURE;
+    for (unsigned attempt = 0; attempt < MAP_MPH_MAX_SEEDS; ++attempt)
+    {
+        uint64_t s = _map_mix(attempt + 1);
+
+        /* group keys by bucket with a counting sort */
+        memset(bucket_start, 0, (nb + 2) * sizeof(size_t));
+        for (size_t i = 0; i < n; ++i)
+        {
+            mixed[i] = _map_mix((uint64_t)hashes[i] ^ s);
+            ++bucket_start[mixed[i] % nb + 2];
+        }
+        for (size_t b = 0; b < nb; ++b)
+            bucket_start[b + 2] += bucket_start[b + 1];
+        for (size_t i = 0; i < n; ++i)
+            by_bucket[bucket_start[mixed[i] % nb + 1]++] = i;
+
+        /* order buckets from largest to smallest, again by counting sort */
+        memset(size_start, 0, (n + 2) * sizeof(size_t));
+        for (size_t b = 0; b < nb; ++b)
+            ++size_start[n - (bucket_start[b + 1] - bucket_start[b]) + 1];
+        for (size_t k = 0; k < n; ++k)
+            size_start[k + 1] += size_start[k];
+        for (size_t b = 0; b < nb; ++b)
+            by_size[size_start[n - (bucket_start[b + 1] - bucket_start[b])]++]
+                = b;
+
+        memset(taken, 0, (ns / 64 + 1) * sizeof(uint64_t));
+        bool placed_all = true;
+        for (size_t o = 0; o < nb && placed_all; ++o)
+        {
+            size_t b = by_size[o];
+            size_t begin = bucket_start[b];
+            size_t len = bucket_start[b + 1] - begin;
+            if (len == 0)
+                break; /* every remaining bucket is empty */
+            for (size_t j = 1; j < len; ++j)
+            {
+                for (size_t k = 0; k < j; ++k)
+                {
+                    /* equal hashes can never be told apart by any pilot */
+                    if (mixed[by_bucket[begin + j]] ==
+                        mixed[by_bucket[begin + k]])
+                    {
+                        status = MAP_INPUT_OUT_OF_RANGE;
+                        goto done;
+                    }
+                }
+            }
+            uint32_t pilot = 0;
+            for (; pilot < MAP_MPH_MAX_PILOT; ++pilot)
+            {
+                uint64_t pilot_hash = _map_mph_pilot_hash(pilot);
+                size_t j = 0;
+                for (; j < len; ++j)
+                {
+                    size_t slot = _map_mph_slot(mixed[by_bucket[begin + j]],
+                        pilot_hash, ns);
+                    if (taken[slot / 64] >> (slot % 64) & 1)
+                        break;
+                    size_t k = 0;
+                    while (k < j && trial[k] != slot)
+                        ++k;
+                    if (k < j)
+                        break;
+                    trial[j] = slot;
+                }
+                if (j == len)
+                    break;
+            }
+            if (pilot == MAP_MPH_MAX_PILOT)
+            {
+                placed_all = false;
+                break;
+            }
+            p[b] = pilot;
+            for (size_t j = 0; j < len; ++j)
+                taken[trial[j] / 64] |= UINT64_C(1) << (trial[j] % 64);
+        }
+        if (placed_all)
+        {
+            /* exactly as many slots below n are free as are taken past it */
+            size_t free_slot = 0;
+            for (size_t slot = n; slot < ns; ++slot)
+            {
+                if (!(taken[slot / 64] >> (slot % 64) & 1))
+                    continue;
+                while (taken[free_slot / 64] >> (free_slot % 64) & 1)
+                    ++free_slot;
+                remap[slot - n] = free_slot++;
+            }
+            mph->seed = s;
+            mph->nkeys = n;
+            mph->nslots = ns;
+            mph->nbuckets = nb;
+            mph->pilots = p;
+            mph->remap = remap;
+            p = NULL;
+            remap = NULL;
+            status = MAP_SUCCESS;
+            break;
+        }
+    }
+
+done:
+    free(mixed);
+    free(bucket_start);
+    free(by_bucket);
+    free(size_start);
+    free(by_size);
+    free(trial);
+    free(taken);
+    free(p);
+    free(remap);
+    return status;
+}
+
+static inline int _map_hash_cmp(const void* a, const void* b)
+{
+    size_t hash_a = *(const size_t*)a;
+    size_t hash_b = *(const size_t*)b;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+// Sorts hashes in place and moves one copy of each distinct hash to the front,
+// returning how many there are.
+static inline size_t _map_unique_hashes(size_t* hashes, size_t n)
+{
+    qsort(hashes, n, sizeof(size_t), _map_hash_cmp);
+    size_t nunique = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (nunique == 0 || hashes[i] != hashes[nunique - 1])
+            hashes[nunique++] = hashes[i];
+    }
+    return nunique;
+}
+
+// Different keys may share a hash, so the perfect hash is built over the
+// distinct hashes. Keys are then laid out in _table grouped by the position
+// of their hash, and _groups[g] is the start of the group at position g. When
+// every hash is distinct the groups are single slots and _groups is NULL.
+#define _map_freeze(frozen, map)                                               \
+do                                                                             \
+{                                                                              \
+    /* a map_ool stores slab indices as values, so only plain maps freeze */   \
+    (void)sizeof(map._log);                                                    \
+    frozen._nelem = 0;                                                         \
+    memset(&frozen._mph, 0, sizeof(frozen._mph));                              \
+    frozen._groups = NULL;                                                     \
+    frozen._hash_f = map._hash_f;                                              \
+    frozen._key_eq_f = map._key_eq_f;                                          \
+    size_t __n = map._nelem;                                                   \
+    /* calloc rather than malloc to shut gcc -Wmaybe-uninitialized up */       \
+    size_t* __hashes = calloc(__n + 1, sizeof(size_t));                        \
+    size_t* __slots = malloc((__n + 1) * sizeof(size_t));                      \
+    size_t* __groups = calloc(__n + 2, sizeof(size_t));                        \
+    frozen._table = malloc((__n + 1) * sizeof(frozen._tmp));                   \
+    if (!__hashes || !__slots || !__groups || !frozen._table)                  \
+    {                                                                          \
+        free(__hashes);                                                        \
+        free(__slots);                                                         \
+        free(__groups);                                                        \
+        free(frozen._table);                                                   \
+        frozen._table = NULL;                                                  \
+        frozen.status = MAP_ALLOC_FAILURE;                                     \
+        break;                                                                 \
+    }                                                                          \
+    /* reuse the hashes stored in the table rather than rehashing keys */      \
+    size_t __table_len = _map_pow2(map._bits);                                 \
+    size_t __j = 0;                                                            \
+    for (size_t __i = 0; __i < __table_len; ++__i)                             \
+    {                                                                          \
+        if ((map._table)[__i]._in_use)                                         \
+            __hashes[__j++] = (map._table)[__i]._hash;                         \
+    }                                                                          \
+    size_t __nkeys = __n;                                                      \
+    frozen.status = _map_mph_build(__hashes, __nkeys, &frozen._mph);           \
+    if (frozen.status == MAP_INPUT_OUT_OF_RANGE)                               \
+    {                                                                          \
+        __nkeys = _map_unique_hashes(__hashes, __n);                           \
+        frozen.status = _map_mph_build(__hashes, __nkeys, &frozen._mph);       \
+    }                                                                          \
+    if (frozen.status != MAP_SUCCESS)                                          \
+    {                                                                          \
+        free(frozen._table);                                                   \
+        frozen._table = NULL;                                                  \
+        free(__groups);                                                        \
+        __groups = NULL;                                                       \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        /* counting sort of the elements by the position of their hash */      \
+        __j = 0;                                                               \
+        for (size_t __i = 0; __i < __table_len; ++__i)                         \
+        {                                                                      \
+            if ((map._table)[__i]._in_use)                                     \
+            {                                                                  \
+                __slots[__j] =                                                 \
+                    _map_mph_lookup(&frozen._mph, (map._table)[__i]._hash);    \
+                ++__groups[__slots[__j++] + 2];                                \
+            }                                                                  \
+        }                                                                      \
+        for (size_t __g = 0; __g < __nkeys; ++__g)                             \
+            __groups[__g + 2] += __groups[__g + 1];                            \
+        __j = 0;                                                               \
+        for (size_t __i = 0; __i < __table_len; ++__i)                         \
+        {                                                                      \
+            if ((map._table)[__i]._in_use)                                     \
+            {                                                                  \
+                size_t __slot = __groups[__slots[__j++] + 1]++;                \
+                frozen._table[__slot]._key = (map._table)[__i]._key;           \
+                frozen._table[__slot]._value = (map._table)[__i]._value;       \
+            }                                                                  \
+        }                                                                      \
+        frozen._nelem = __n;                                                   \
+        if (__nkeys == __n)                                                    \
+        {                                                                      \
+            free(__groups);                                                    \
+            __groups = NULL;                                                   \
+        }                                                                      \
+    }                                                                          \
+    frozen._groups = __groups;                                                 \
+    free(__hashes);                                                            \
+    free(__slots);                                                             \
+}while(0)
+
+#define _map_frozen_deinit(frozen)                                             \
+do                                                                             \
+{                                                                              \
+    _map_mph_destroy(&frozen._mph);                                            \
+    free(frozen._groups);                                                      \
+    free(frozen._table);                                                       \
+    frozen._groups = NULL;                                                     \
+    frozen._table = NULL;                                                      \
+    frozen.status = MAP_SUCCESS;                                               \
+}while(0)
+
+#define _map_frozen_key_exists(ans, frozen, key)                               \
+do                                                                             \
+{                                                                              \
+    frozen._tmp._key = key;                                                    \
+    ans = false;                                                               \
+    if (frozen._nelem)                                                         \
+    {                                                                          \
+        size_t __begin = _map_mph_lookup(&frozen._mph,                         \
+            (frozen._hash_f)(&(frozen._tmp._key)));                            \
+        size_t __end = __begin + 1;                                            \
+        if (frozen._groups)                                                    \
+        {                                                                      \
+            __end = frozen._groups[__begin + 1];                               \
+            __begin = frozen._groups[__begin];                                 \
+        }                                                                      \
+        for (size_t __slot = __begin; __slot < __end; ++__slot)                \
+        {                                                                      \
+            if (frozen._key_eq_f(&(frozen._table[__slot]._key),                \
+                &(frozen._tmp._key)))                                          \
+            {                                                                  \
+                ans = true;                                                    \
+                /* map_frozen_get needs the value at __slot */                 \
+                frozen._tmp._value = frozen._table[__slot]._value;             \
+                break;                                                         \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+    frozen.status = MAP_SUCCESS;                                               \
+}while(0)
+
+#define _map_frozen_get(ans, frozen, key)                                      \
+do                                                                             \
+{                                                                              \
+    bool __key_exists;                                                         \
+    _map_frozen_key_exists(__key_exists, frozen, key);                         \
+    if (__key_exists)                                                          \
+    {                                                                          \
+        ans = frozen._tmp._value;                                              \
+        frozen.status = MAP_SUCCESS;                                           \
+    }                                                                          \
+    else                                                                       \
+    {                                                                          \
+        memset(&ans, 0, sizeof(ans)); /* to shut clang up */                   \
+        frozen.status = MAP_KEY_NOT_FOUND;                                     \
+    }                                                                          \
+}while(0)
+
+// Serialized layout (native byte order): magic, version, element size,
+// element count, distinct hash count, seed, then the pilots, the remapped
+// slots, the group starts if any keys share a hash, and the table itself.
+static inline MAP_STATUS _map_frozen_fwrite(FILE* file, size_t elem_size,
+    size_t nelem, const map_mph* mph, const size_t* groups, const void* table)
+{
+    uint32_t version = MAP_FROZEN_VERSION;
+    uint64_t header[4] = {elem_size, nelem, mph->nkeys, mph->seed};
+    if (fwrite(MAP_FROZEN_MAGIC, 1, 4, file) != 4 ||
+        fwrite(&version, sizeof(version), 1, file) != 1 ||
+        fwrite(header, sizeof(header), 1, file) != 1)
+    {
+        return MAP_IO_FAILURE;
+    }
+    if (nelem == 0)
+        return MAP_SUCCESS;
+    size_t nremap = mph->nslots - mph->nkeys;
+    if (fwrite(mph->pilots, sizeof(uint32_t), mph->nbuckets, file) !=
+            mph->nbuckets ||
+        fwrite(mph->remap, sizeof(size_t), nremap, file) != nremap ||
+        (groups && fwrite(groups, sizeof(size_t), mph->nkeys + 1, file) !=
+            mph->nkeys + 1) ||
+        fwrite(table, elem_size, nelem, file) != nelem)
+    {
+        return MAP_IO_FAILURE;
+    }
+    return MAP_SUCCESS;
+}
+
+// Everything read is checked to be consistent before it is used, so a corrupt
+// file gives MAP_IO_FAILURE rather than out of range lookups.
+static inline MAP_STATUS _map_frozen_fread(FILE* file, size_t elem_size,
+    size_t* nelem, map_mph* mph, size_t** groups, void** table)
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t header[4];
+    if (fread(magic, 1, 4, file) != 4 ||
+        memcmp(magic, MAP_FROZEN_MAGIC, 4) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 ||
+        version != MAP_FROZEN_VERSION ||
+        fread(header, sizeof(header), 1, file) != 1)
+    {
+        return MAP_IO_FAILURE;
+    }
+    if (header[0] != elem_size)
+        return MAP_INPUT_OUT_OF_RANGE;
+    size_t n = (size_t)header[1];
+    size_t nkeys = (size_t)header[2];
+    if (header[1] != n || header[2] != nkeys || nkeys > n ||
+        (n > 0 && nkeys == 0) || n > (SIZE_MAX - 1) / elem_size - 1 ||
+        n > SIZE_MAX / sizeof(size_t) - 2)
+    {
+        return MAP_IO_FAILURE;
+    }
+    if (n == 0)
+    {
+        *nelem = 0;
+        return MAP_SUCCESS;
+    }
+
+    size_t nb = _map_mph_nbuckets(nkeys);
+    size_t nremap = _map_mph_nslots(nkeys) - nkeys;
+    size_t ngroups = nkeys < n ? nkeys + 1 : 0;
+    uint32_t* p = malloc(nb * sizeof(uint32_t));
+    size_t* remap = malloc(nremap * sizeof(size_t));
+    size_t* g = ngroups ? malloc(ngroups * sizeof(size_t)) : NULL;
+    void* t = malloc(n * elem_size);
+    MAP_STATUS status = MAP_ALLOC_FAILURE;
+    if (!p || !remap || (ngroups && !g) || !t)
+        goto fail;
+    status = MAP_IO_FAILURE;
+    if (fread(p, sizeof(uint32_t), nb, file) != nb ||
+        fread(remap, sizeof(size_t), nremap, file) != nremap ||
+        (g && fread(g, sizeof(size_t), ngroups, file) != ngroups) ||
+        fread(t, elem_size, n, file) != n)
+    {
+        goto fail;
+    }
+    for (size_t i = 0; i < nremap; ++i)
+    {
+        if (remap[i] >= nkeys)
+            goto fail;
+    }
+    /* every group is a non-empty range and together they cover the table */
+    for (size_t i = 0; i + 1 < ngroups; ++i)
+    {
+        if (g[i] >= g[i + 1])
+            goto fail;
+    }
+    if (ngroups && (g[0] != 0 || g[ngroups - 1] != n))
+        goto fail;
+
+    *nelem = n;
+    mph->seed = header[3];
+    mph->nkeys = nkeys;
+    mph->nslots = nkeys + nremap;
+    mph->nbuckets = nb;
+    mph->pilots = p;
+    mph->remap = remap;
+    *groups = g;
+    *table = t;
+    return MAP_SUCCESS;
+
+fail:
+    free(p);
+    free(remap);
+    free(g);
+    free(t);
+    return status;
+}
+
+#define _map_frozen_write(frozen, file)                                        \
+do                                                                             \
+{                                                                              \
+    frozen.status = _map_frozen_fwrite(file, sizeof(frozen._tmp),              \
+        frozen._nelem, &frozen._mph, frozen._groups, frozen._table);           \
+}while(0)
+
+#define _map_frozen_read(frozen, file, hash_f, key_eq_f)                       \
+do                                                                             \
+{                                                                              \
+    void* __table = NULL;                                                      \
+    frozen._nelem = 0;                                                         \
+    memset(&frozen._mph, 0, sizeof(frozen._mph));                              \
+    frozen._groups = NULL;                                                     \
+    frozen._hash_f = hash_f;                                                   \
+    frozen._key_eq_f = key_eq_f;                                               \
+    frozen.status = _map_frozen_fread(file, sizeof(frozen._tmp),               \
+        &frozen._nelem, &frozen._mph, &frozen._groups, &__table);              \
+    frozen._table = __table;                                                   \
+}while(0)
+
 static inline size_t djb_str(void* key)
 {
     char* str = (char*)key;
@@ -355,14 +2342,15 @@ MAP_UNUSED static bool int64_eq(void* i1, void* i2)
     return *((int64_t*)i1) == *((int64_t*)i2);
 }
 
+// Keys are char*, so these receive a pointer to the char*.
 MAP_UNUSED static size_t str_hash(void* key)
 {
-    return djb_str(key);
+    return djb_str(*(char**)key);
 }
 
 MAP_UNUSED static bool str_eq(void* str1, void* str2)
 {
-    return strcmp(str1, str2) == 0;
+    return strcmp(*(char**)str1, *(char**)str2) == 0;
 }
 
 #endif // !_MAP_H_
@@ -5,6 +5,9 @@
 #   define _EMU_ENABLE_COLOR_
 #endif
 #include <EMUtest.h>
+#include <time.h>
+#define MAP_ENABLE_LOG
+#define MAP_ENABLE_PARALLEL
 #include "map.h"
 
 size_t test_hash_int(void* key)
@@ -24,6 +27,8 @@ EMU_TEST(init_and_deinit)
 
     map_init(m, test_hash_int, int_eq, 100);
     EMU_REQUIRE_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    map_init(m, test_hash_int, int_eq, MAP_BITS_PER_SIZE_T);
+    EMU_REQUIRE_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
 
     map_init(m, test_hash_int, int_eq, 16);
     EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
@@ -144,6 +149,51 @@ EMU_TEST(map_key_exists)
     EMU_END_TEST();
 }
 
+EMU_TEST(key_exists_past_displaced_run)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 4);
+    bool ans;
+
+    // 17 is displaced from bucket 1 into 2, pushing 2 out to bucket 3
+    map_set(m, 1, 1);
+    map_set(m, 17, 17);
+    map_set(m, 2, 2);
+    map_key_exists(ans, m, 2);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(ans);
+    map_key_exists(ans, m, 18);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_FALSE(ans);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(str_keys_compare_contents)
+{
+    map(char*, int) m;
+    map_init(m, str_hash, str_eq, 4);
+    bool ans;
+
+    // equal strings at different addresses must be the same key
+    char first[] = "latte";
+    char second[] = "latte";
+    char other[] = "mocha";
+    map_set(m, first, 1);
+    map_set(m, second, 2);
+    EMU_EXPECT_EQ_UINT(m._nelem, 1);
+    int value;
+    map_get(value, m, first);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_INT(value, 2);
+    map_key_exists(ans, m, other);
+    EMU_EXPECT_FALSE(ans);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
 EMU_TEST(map_get)
 {
     map(int, int) m;
@@ -220,10 +270,34 @@ EMU_TEST(complex_remove_with_swaps)
     EMU_END_TEST();
 }
 
+EMU_TEST(remove_stops_at_home_bucket)
+{
+    // Elements already in their home bucket must not be shifted back.
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 4);
+    bool ans;
+
+    map_set(m, 1, 10);
+    map_set(m, 2, 20);
+    map_set(m, 3, 30);
+    map_remove(m, 1);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_FALSE((m._table)[1]._in_use);
+    EMU_EXPECT_EQ_INT((m._table)[2]._value, 20);
+    map_key_exists(ans, m, 2);
+    EMU_EXPECT_TRUE(ans);
+    map_key_exists(ans, m, 3);
+    EMU_EXPECT_TRUE(ans);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
 EMU_GROUP(map_remove)
 {
     EMU_ADD(basic_remove);
     EMU_ADD(complex_remove_with_swaps);
+    EMU_ADD(remove_stops_at_home_bucket);
     EMU_END_GROUP();
 }
 
@@ -310,16 +384,1224 @@ EMU_TEST(map_keys)
     EMU_END_TEST();
 }
 
+typedef struct
+{
+    int id;
+    char payload[200];
+} big_value;
+
+EMU_TEST(ool_init_and_deinit)
+{
+    map_ool(int, big_value) m;
+
+    map_ool_init(m, test_hash_int, int_eq, MAP_OOL_MAX_BITS + 1);
+    EMU_REQUIRE_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    // the largest valid table size must not overflow an int shift
+    EMU_EXPECT_EQ_UINT(_map_pow2(MAP_OOL_MAX_BITS), 2147483648u);
+
+    map_ool_init(m, test_hash_int, int_eq, MAP_DEFAULT_BITS);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(m._slab_top, 0);
+    map_ool_deinit(m);
+
+    EMU_END_TEST();
+}
+
+EMU_TEST(ool_set_and_get)
+{
+    map_ool(int, big_value) m;
+    map_ool_init(m, test_hash_int, int_eq, 4);
+    big_value v = {0};
+    big_value ans;
+    big_value* ref;
+    big_value* ref_after;
+
+    v.id = 3;
+    map_ool_set(m, 0, v);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    v.id = 5;
+    map_ool_set(m, 16, v); // collides with key 0 and is displaced
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(m._nelem, 2);
+    EMU_EXPECT_EQ_UINT((m._table)[1]._value, 1);
+
+    map_ool_get(ans, m, 0);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_INT(ans.id, 3);
+    map_ool_get(ans, m, 16);
+    EMU_EXPECT_EQ_INT(ans.id, 5);
+    map_ool_get(ans, m, 1);
+    EMU_EXPECT_EQ(m.status, MAP_KEY_NOT_FOUND);
+
+    // overwriting keeps the value at the same address
+    map_ool_ref(ref, m, 16);
+    v.id = 7;
+    map_ool_set(m, 16, v);
+    map_ool_ref(ref_after, m, 16);
+    EMU_EXPECT_TRUE(ref == ref_after);
+    EMU_EXPECT_EQ_INT(ref->id, 7);
+    EMU_EXPECT_EQ_UINT(m._slab_top, 2);
+
+    map_ool_ref(ref, m, 1);
+    EMU_EXPECT_EQ(m.status, MAP_KEY_NOT_FOUND);
+    EMU_EXPECT_TRUE(ref == NULL);
+
+    map_ool_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(ool_remove_reuses_slots)
+{
+    map_ool(int, big_value) m;
+    map_ool_init(m, test_hash_int, int_eq, 4);
+    big_value v = {0};
+    big_value* ref;
+    bool ans;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        v.id = i;
+        map_ool_set(m, i, v);
+    }
+    map_ool_ref(ref, m, 3);
+
+    map_ool_remove(m, 1);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(m._nelem, 3);
+    EMU_EXPECT_EQ_UINT(m._free_head, 1);
+    map_key_exists(ans, m, 1);
+    EMU_EXPECT_FALSE(ans);
+    map_ool_remove(m, 1);
+    EMU_EXPECT_EQ(m.status, MAP_KEY_NOT_FOUND);
+
+    // the freed slot is handed out again before the slab grows
+    v.id = 9;
+    map_ool_set(m, 9, v);
+    EMU_EXPECT_EQ_UINT(m._slab_top, 4);
+    EMU_EXPECT_EQ(m._free_head, MAP_SLAB_NIL);
+    EMU_EXPECT_EQ_INT(m._slab[1]._value.id, 9);
+
+    // unrelated values did not move
+    big_value* ref_after;
+    map_ool_ref(ref_after, m, 3);
+    EMU_EXPECT_TRUE(ref == ref_after);
+
+    map_ool_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(ool_values)
+{
+    map_ool(int, big_value) m;
+    map_ool_init(m, test_hash_int, int_eq, MAP_DEFAULT_BITS);
+    big_value v = {0};
+
+    for (int i = 0; i < 8; ++i)
+    {
+        v.id = i * 10;
+        map_ool_set(m, i * 1000, v);
+    }
+    map_ool_remove(m, 3000);
+
+    size_t len;
+    map_length(len, m);
+    EMU_REQUIRE_EQ(len, 7);
+    big_value values[8];
+    map_ool_values(values, m);
+    int sum = 0;
+    for (size_t i = 0; i < len; ++i)
+        sum += values[i].id;
+    EMU_EXPECT_EQ_INT(sum, 280 - 30);
+
+    map_ool_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(out_of_line_values)
+{
+    EMU_ADD(ool_init_and_deinit);
+    EMU_ADD(ool_set_and_get);
+    EMU_ADD(ool_remove_reuses_slots);
+    EMU_ADD(ool_values);
+    EMU_END_GROUP();
+}
+
+void double_value(void* key, void* value, void* ctx)
+{
+    (void)key;
+    (void)ctx;
+    *(int*)value *= 2;
+}
+
+void sum_fold(void* key, void* value, void* acc)
+{
+    ((long*)acc)[0] += *(int*)key;
+    ((long*)acc)[1] += *(int*)value;
+}
+
+void sum_combine(void* acc, void* partial)
+{
+    ((long*)acc)[0] += ((long*)partial)[0];
+    ((long*)acc)[1] += ((long*)partial)[1];
+}
+
+EMU_TEST(parallel_for)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 12);
+    for (int i = 0; i < 3000; ++i)
+        map_set(m, i * 7, i);
+    // ranges only start on cache line boundaries if the table does
+    EMU_EXPECT_EQ_UINT((uintptr_t)m._table % MAP_CACHE_LINE, 0);
+
+    map_parallel_for(m, double_value, NULL, 0);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+
+    map_parallel_for(m, double_value, NULL, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    for (int i = 0; i < 3000; ++i)
+    {
+        int ans;
+        map_get(ans, m, i * 7);
+        EMU_EXPECT_EQ_INT(ans, 2 * i);
+    }
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(parallel_reduce)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 12);
+    long expected_keys = 0;
+    long expected_values = 0;
+    for (int i = 0; i < 3000; ++i)
+    {
+        map_set(m, i * 7, i);
+        expected_keys += i * 7;
+        expected_values += i;
+    }
+
+    long sums[2] = {0, 0};
+    map_parallel_reduce(sums, m, sum_fold, sum_combine, 0);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+
+    map_parallel_reduce(sums, m, sum_fold, sum_combine, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(sums[0] == expected_keys);
+    EMU_EXPECT_TRUE(sums[1] == expected_values);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(parallel_more_threads_than_lines)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 2);
+    map_set(m, 0, 1);
+    map_set(m, 3, 2);
+
+    long sums[2] = {0, 0};
+    map_parallel_reduce(sums, m, sum_fold, sum_combine, 16);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(sums[0] == 3);
+    EMU_EXPECT_TRUE(sums[1] == 3);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(parallel_ool)
+{
+    map_ool(int, int) m;
+    map_ool_init(m, test_hash_int, int_eq, 10);
+    for (int i = 0; i < 600; ++i)
+        map_ool_set(m, i * 3, i);
+
+    // fn must see the values in the slab, not their slab indices
+    map_ool_parallel_for(m, double_value, NULL, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    long sums[2] = {0, 0};
+    map_ool_parallel_reduce(sums, m, sum_fold, sum_combine, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(sums[0] == 3L * 599 * 600 / 2);
+    EMU_EXPECT_TRUE(sums[1] == 599L * 600);
+
+    map_ool_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(parallel_traversal)
+{
+    EMU_ADD(parallel_for);
+    EMU_ADD(parallel_reduce);
+    EMU_ADD(parallel_more_threads_than_lines);
+    EMU_ADD(parallel_ool);
+    EMU_END_GROUP();
+}
+
+size_t constant_hash(void* key)
+{
+    (void)key;
+    return 42;
+}
+
+EMU_TEST(freeze_and_get)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 12);
+    for (int i = 0; i < 1000; ++i)
+        map_set(m, i * 3, i);
+
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    map_deinit(m); // the frozen map owns a copy of the contents
+
+    size_t len;
+    map_length(len, f);
+    EMU_EXPECT_EQ_UINT(len, 1000);
+    for (int i = 0; i < 1000; ++i)
+    {
+        int ans;
+        map_frozen_get(ans, f, i * 3);
+        EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+        EMU_EXPECT_EQ_INT(ans, i);
+    }
+
+    bool exists;
+    map_frozen_key_exists(exists, f, 1);
+    EMU_EXPECT_FALSE(exists);
+    int ans;
+    map_frozen_get(ans, f, 3001);
+    EMU_EXPECT_EQ(f.status, MAP_KEY_NOT_FOUND);
+
+    map_frozen_deinit(f);
+    EMU_END_TEST();
+}
+
+EMU_TEST(freeze_empty_map)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 4);
+
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    bool exists;
+    map_frozen_key_exists(exists, f, 0);
+    EMU_EXPECT_FALSE(exists);
+
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(freeze_string_keys)
+{
+    map(char*, int) m;
+    map_init(m, str_hash, str_eq, 4);
+    map_set(m, "black", 250);
+    map_set(m, "latte", 400);
+    map_set(m, "frap", 425);
+
+    map_frozen(char*, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    int cost;
+    map_frozen_get(cost, f, "latte");
+    EMU_EXPECT_EQ_INT(cost, 400);
+    map_frozen_get(cost, f, "mocha");
+    EMU_EXPECT_EQ(f.status, MAP_KEY_NOT_FOUND);
+
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(freeze_identical_hashes)
+{
+    // keys with identical hashes share a group that lookups search
+    map(int, int) m;
+    map_init(m, constant_hash, int_eq, 4);
+    map_set(m, 1, 10);
+    map_set(m, 2, 20);
+    map_set(m, 3, 30);
+
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    for (int i = 1; i <= 3; ++i)
+    {
+        int ans;
+        map_frozen_get(ans, f, i);
+        EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+        EMU_EXPECT_EQ_INT(ans, i * 10);
+    }
+    bool exists;
+    map_frozen_key_exists(exists, f, 4);
+    EMU_EXPECT_FALSE(exists);
+
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(freeze_builtin_int_hash)
+{
+    // int32_hash gives many keys in this range the same hash
+    map(int, int) m;
+    map_init(m, int32_hash, int32_eq, 14);
+    for (int i = 0; i < 10000; ++i)
+        map_set(m, i, -i);
+
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(f._groups != NULL);
+    for (int i = 0; i < 10000; ++i)
+    {
+        int ans;
+        map_frozen_get(ans, f, i);
+        EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+        EMU_EXPECT_EQ_INT(ans, -i);
+    }
+    bool exists;
+    map_frozen_key_exists(exists, f, 10000);
+    EMU_EXPECT_FALSE(exists);
+
+    // the groups survive a round trip through a file
+    FILE* file = tmpfile();
+    EMU_REQUIRE_TRUE(file != NULL);
+    map_frozen_write(f, file);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+    rewind(file);
+    map_frozen(int, int) loaded;
+    map_frozen_read(loaded, file, int32_hash, int32_eq);
+    EMU_REQUIRE_EQ(loaded.status, MAP_SUCCESS);
+    for (int i = 0; i < 10000; ++i)
+    {
+        int ans;
+        map_frozen_get(ans, loaded, i);
+        EMU_REQUIRE_EQ(loaded.status, MAP_SUCCESS);
+        EMU_EXPECT_EQ_INT(ans, -i);
+    }
+    map_frozen_deinit(loaded);
+    fclose(file);
+
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+size_t mixing_hash(void* key)
+{
+    return (size_t)_map_mix((uint64_t)*(int*)key);
+}
+
+// Freezes the keys 0..n-1 and returns how many of them then look up wrong,
+// or -1 if the freeze failed.
+int freeze_mixed_keys(int n, unsigned bits)
+{
+    map(int, int) m;
+    map_init(m, mixing_hash, int_eq, bits);
+    if (m.status != MAP_SUCCESS)
+        return -1;
+    for (int i = 0; i < n; ++i)
+        map_set(m, i, i);
+
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    map_deinit(m);
+    if (f.status != MAP_SUCCESS)
+        return -1;
+    // slots past the keys are remapped, and there are no hash collisions
+    int wrong = f._mph.nslots > f._mph.nkeys && f._groups == NULL ? 0 : n;
+    for (int i = 0; i < n; ++i)
+    {
+        int ans;
+        map_frozen_get(ans, f, i);
+        wrong += f.status != MAP_SUCCESS || ans != i;
+    }
+    map_frozen_deinit(f);
+    return wrong;
+}
+
+EMU_TEST(freeze_many_keys)
+{
+    EMU_EXPECT_EQ_INT(freeze_mixed_keys(100000, 17), 0);
+    EMU_END_TEST();
+}
+
+#ifdef MAP_TEST_LARGE
+// Only built by `make large_tests`, since it takes seconds rather than
+// milliseconds.
+EMU_TEST(freeze_millions_of_keys)
+{
+    clock_t start = clock();
+    EMU_EXPECT_EQ_INT(freeze_mixed_keys(3000000, 22), 0);
+    printf("froze and checked 3000000 keys in %.2fs\n",
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+    EMU_END_TEST();
+}
+#endif
+
+EMU_TEST(frozen_write_and_read)
+{
+    map(int, double) m;
+    map_init(m, test_hash_int, int_eq, 10);
+    for (int i = 0; i < 500; ++i)
+        map_set(m, i, i / 2.0);
+    map_frozen(int, double) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+
+    FILE* file = tmpfile();
+    EMU_REQUIRE_TRUE(file != NULL);
+    map_frozen_write(f, file);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+
+    rewind(file);
+    map_frozen(int, double) loaded;
+    map_frozen_read(loaded, file, test_hash_int, int_eq);
+    EMU_REQUIRE_EQ(loaded.status, MAP_SUCCESS);
+    for (int i = 0; i < 500; ++i)
+    {
+        double ans;
+        map_frozen_get(ans, loaded, i);
+        EMU_REQUIRE_EQ(loaded.status, MAP_SUCCESS);
+        EMU_EXPECT_FEQ(ans, i / 2.0, EMU_DEFAULT_EPSILON);
+    }
+    map_frozen_deinit(loaded);
+
+    // element size mismatch
+    rewind(file);
+    map_frozen(int, int) wrong;
+    map_frozen_read(wrong, file, test_hash_int, int_eq);
+    EMU_EXPECT_EQ(wrong.status, MAP_INPUT_OUT_OF_RANGE);
+
+    // truncated input
+    fclose(file);
+    file = tmpfile();
+    fwrite("GCMF", 1, 4, file);
+    rewind(file);
+    map_frozen_read(wrong, file, test_hash_int, int_eq);
+    EMU_EXPECT_EQ(wrong.status, MAP_IO_FAILURE);
+
+    fclose(file);
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+// Writes f to a buffer, overwrites the 8 bytes at offset with value, and
+// reads the result back into loaded.
+#define read_corrupted(loaded, f, offset, value)                               \
+do                                                                             \
+{                                                                              \
+    char buffer[4096];                                                         \
+    FILE* file = tmpfile();                                                    \
+    map_frozen_write(f, file);                                                 \
+    size_t len = (size_t)ftell(file);                                          \
+    rewind(file);                                                              \
+    EMU_REQUIRE_TRUE(fread(buffer, 1, len, file) == len);                      \
+    uint64_t patch = (value);                                                  \
+    memcpy(buffer + (offset), &patch, sizeof(patch));                          \
+    rewind(file);                                                              \
+    fwrite(buffer, 1, len, file);                                              \
+    rewind(file);                                                              \
+    map_frozen_read(loaded, file, test_hash_int, int_eq);                      \
+    fclose(file);                                                              \
+}while(0)
+
+EMU_TEST(frozen_read_corrupt_header)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 4);
+    for (int i = 0; i < 4; ++i)
+        map_set(m, i, i);
+    map_frozen(int, int) f;
+    map_freeze(f, m);
+    EMU_REQUIRE_EQ(f.status, MAP_SUCCESS);
+
+    // the header is magic, version, then element size, element count,
+    // distinct hash count and seed as 64 bit values
+    map_frozen(int, int) loaded;
+    read_corrupted(loaded, f, 24, 0);
+    EMU_EXPECT_EQ(loaded.status, MAP_IO_FAILURE);
+    int ans;
+    map_frozen_get(ans, loaded, 1);
+    EMU_EXPECT_EQ(loaded.status, MAP_KEY_NOT_FOUND);
+
+    read_corrupted(loaded, f, 24, 5);
+    EMU_EXPECT_EQ(loaded.status, MAP_IO_FAILURE);
+
+    read_corrupted(loaded, f, 16, UINT64_MAX / 2);
+    EMU_EXPECT_EQ(loaded.status, MAP_IO_FAILURE);
+
+    // the one remapped slot, after two buckets of pilots
+    read_corrupted(loaded, f, 40 + 2 * sizeof(uint32_t), 4);
+    EMU_EXPECT_EQ(loaded.status, MAP_IO_FAILURE);
+
+    read_corrupted(loaded, f, 32, 7); // a different seed is still consistent
+    EMU_EXPECT_EQ(loaded.status, MAP_SUCCESS);
+    map_frozen_deinit(loaded);
+
+    map_frozen_deinit(f);
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(frozen_maps)
+{
+    EMU_ADD(freeze_and_get);
+    EMU_ADD(freeze_empty_map);
+    EMU_ADD(freeze_string_keys);
+    EMU_ADD(freeze_identical_hashes);
+    EMU_ADD(freeze_builtin_int_hash);
+    EMU_ADD(freeze_many_keys);
+#ifdef MAP_TEST_LARGE
+    EMU_ADD(freeze_millions_of_keys);
+#endif
+    EMU_ADD(frozen_write_and_read);
+    EMU_ADD(frozen_read_corrupt_header);
+    EMU_END_GROUP();
+}
+
+EMU_TEST(filter_enable_and_disable)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+    MAP_FILTER_STATS stats;
+
+    map_filter_enable(m, 0);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    map_filter_enable(m, 1.5);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    EMU_EXPECT_TRUE(m._filter == NULL);
+
+    map_filter_enable(m, 0.01);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(m._filter->nhashes, 7);
+    // enabling again replaces the old filter
+    map_filter_enable(m, 0.001);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(m._filter->nhashes, 10);
+
+    map_filter_disable(m);
+    EMU_EXPECT_TRUE(m._filter == NULL);
+    map_filter_stats(stats, m);
+    EMU_EXPECT_EQ_UINT(stats.queries, 0);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(filter_rejects_misses)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 12);
+    for (int i = 0; i < 1000; ++i)
+        map_set(m, i, i);
+    // keys set before the filter was enabled must be picked up
+    map_filter_enable(m, 0.01);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    for (int i = 1000; i < 2000; ++i)
+        map_set(m, i, i);
+
+    bool exists;
+    for (int i = 0; i < 2000; ++i)
+    {
+        map_key_exists(exists, m, i);
+        EMU_REQUIRE_TRUE(exists);
+    }
+    for (int i = 2000; i < 12000; ++i)
+    {
+        map_key_exists(exists, m, i);
+        EMU_REQUIRE_TRUE(!exists);
+    }
+
+    MAP_FILTER_STATS stats;
+    map_filter_stats(stats, m);
+    EMU_EXPECT_EQ_UINT(stats.queries, 12000);
+    EMU_EXPECT_EQ_UINT(stats.negatives + stats.false_positives, 10000);
+    EMU_EXPECT_TRUE(stats.false_positives < 300);
+    EMU_EXPECT_FEQ(stats.hit_rate, stats.negatives / 12000.0,
+        EMU_DEFAULT_EPSILON);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(filter_follows_remove)
+{
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 10);
+    map_filter_enable(m, 0.01);
+    for (int i = 0; i < 500; ++i)
+        map_set(m, i, i);
+    for (int i = 0; i < 500; ++i)
+        map_set(m, i, -i); // overwrites must not be counted twice
+    for (int i = 0; i < 500; ++i)
+        map_remove(m, i);
+
+    // every counter is back to zero, so every lookup is a filter negative
+    MAP_FILTER_STATS before;
+    MAP_FILTER_STATS after;
+    map_filter_stats(before, m);
+    bool exists;
+    for (int i = 0; i < 500; ++i)
+        map_key_exists(exists, m, i);
+    map_filter_stats(after, m);
+    EMU_EXPECT_EQ_UINT(after.negatives - before.negatives, 500);
+
+    map_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_TEST(filter_on_ool_map)
+{
+    map_ool(int, big_value) m;
+    map_ool_init(m, test_hash_int, int_eq, 8);
+    map_filter_enable(m, 0.05);
+    big_value v = {0};
+    big_value ans;
+
+    v.id = 4;
+    map_ool_set(m, 4, v);
+    map_ool_get(ans, m, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_INT(ans.id, 4);
+    map_ool_remove(m, 4);
+    map_ool_get(ans, m, 4);
+    EMU_EXPECT_EQ(m.status, MAP_KEY_NOT_FOUND);
+
+    // the lookup map_ool_set makes to find the key is not counted
+    MAP_FILTER_STATS stats;
+    map_filter_stats(stats, m);
+    EMU_EXPECT_EQ_UINT(stats.queries, 3);
+    EMU_EXPECT_EQ_UINT(stats.negatives, 1);
+    EMU_EXPECT_EQ_UINT(stats.false_positives, 0);
+
+    map_ool_deinit(m);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(lookup_prefilter)
+{
+    EMU_ADD(filter_enable_and_disable);
+    EMU_ADD(filter_rejects_misses);
+    EMU_ADD(filter_follows_remove);
+    EMU_ADD(filter_on_ool_map);
+    EMU_END_GROUP();
+}
+
+#define TEST_LOG "map_test.log"
+#define TEST_SNAPSHOT "map_test.snapshot"
+
+long file_size(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+EMU_TEST(log_open_and_close)
+{
+    remove(TEST_LOG);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+
+    map_log_open(m, TEST_LOG, 0);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    map_log_open(m, TEST_LOG, 4);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) == MAP_LOG_HEADER_SIZE);
+    map_log_open(m, TEST_LOG, 4);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+    map_log_close(m);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(m._log == NULL);
+    map_deinit(m);
+
+    // a log written for other key/value types is rejected
+    map(int, double) other;
+    map_init(other, test_hash_int, int_eq, 8);
+    map_log_open(other, TEST_LOG, 4);
+    EMU_EXPECT_EQ(other.status, MAP_INPUT_OUT_OF_RANGE);
+    map_log_replay(other, TEST_SNAPSHOT, TEST_LOG);
+    EMU_EXPECT_EQ(other.status, MAP_INPUT_OUT_OF_RANGE);
+    map_deinit(other);
+
+    remove(TEST_LOG);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_group_commit)
+{
+    remove(TEST_LOG);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+    map_log_open(m, TEST_LOG, 4);
+    long record_size = 1 + sizeof(int) + sizeof(int);
+
+    map_set(m, 1, 1);
+    map_set(m, 2, 2);
+    map_remove(m, 1);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) == MAP_LOG_HEADER_SIZE);
+    map_set(m, 3, 3);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) ==
+        MAP_LOG_HEADER_SIZE + 4 * record_size);
+
+    // removing a missing key is not logged
+    map_remove(m, 1);
+    map_set(m, 4, 4);
+    map_log_sync(m);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) ==
+        MAP_LOG_HEADER_SIZE + 5 * record_size);
+
+    map_deinit(m);
+    remove(TEST_LOG);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_replay)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+    map_log_open(m, TEST_LOG, 3);
+    for (int i = 0; i < 20; ++i)
+        map_set(m, i, i);
+    for (int i = 0; i < 20; i += 2)
+        map_remove(m, i);
+    map_set(m, 1, 100);
+    map_deinit(m); // commits the last partial batch
+
+    map(int, int) r;
+    map_init(r, test_hash_int, int_eq, 8);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    size_t len;
+    map_length(len, r);
+    EMU_EXPECT_EQ_UINT(len, 10);
+    int ans;
+    map_get(ans, r, 1);
+    EMU_EXPECT_EQ_INT(ans, 100);
+    map_get(ans, r, 19);
+    EMU_EXPECT_EQ_INT(ans, 19);
+    map_get(ans, r, 4);
+    EMU_EXPECT_EQ(r.status, MAP_KEY_NOT_FOUND);
+
+    // replaying into a map that is already logging would log twice
+    map_log_open(r, TEST_LOG, 3);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_EXPECT_EQ(r.status, MAP_INPUT_OUT_OF_RANGE);
+
+    map_deinit(r);
+    remove(TEST_LOG);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_compact)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 12);
+
+    map_log_compact(m, TEST_SNAPSHOT);
+    EMU_EXPECT_EQ(m.status, MAP_INPUT_OUT_OF_RANGE);
+
+    map_log_open(m, TEST_LOG, 16);
+    for (int i = 0; i < 3000; ++i)
+        map_set(m, i, i);
+    map_log_compact(m, TEST_SNAPSHOT);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) == MAP_LOG_HEADER_SIZE);
+    EMU_EXPECT_TRUE(file_size(TEST_SNAPSHOT) ==
+        MAP_LOG_HEADER_SIZE + 8 + 3000 * 2 * (long)sizeof(int));
+
+    map_remove(m, 0);
+    map_set(m, 1, -1);
+    map_deinit(m);
+
+    map(int, int) r;
+    map_init(r, test_hash_int, int_eq, 12);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    size_t len;
+    map_length(len, r);
+    EMU_EXPECT_EQ_UINT(len, 2999);
+    int ans;
+    map_get(ans, r, 1);
+    EMU_EXPECT_EQ_INT(ans, -1);
+    map_get(ans, r, 2999);
+    EMU_EXPECT_EQ_INT(ans, 2999);
+    bool exists;
+    map_key_exists(exists, r, 0);
+    EMU_EXPECT_FALSE(exists);
+
+    map_deinit(r);
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_torn_record)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+    map_log_open(m, TEST_LOG, 1);
+    map_set(m, 1, 10);
+    map_set(m, 2, 20);
+    map_deinit(m);
+    long whole = file_size(TEST_LOG);
+
+    // simulate a crash in the middle of writing a record
+    FILE* file = fopen(TEST_LOG, "ab");
+    fwrite("S\x03", 1, 2, file);
+    fclose(file);
+
+    map(int, int) r;
+    map_init(r, test_hash_int, int_eq, 8);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    size_t len;
+    map_length(len, r);
+    EMU_EXPECT_EQ_UINT(len, 2);
+
+    // reopening drops the torn record so new records line up again
+    map_log_open(r, TEST_LOG, 1);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    EMU_EXPECT_TRUE(file_size(TEST_LOG) == whole);
+    map_set(r, 3, 30);
+    map_deinit(r);
+
+    map_init(r, test_hash_int, int_eq, 8);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    int ans;
+    map_get(ans, r, 3);
+    EMU_EXPECT_EQ_INT(ans, 30);
+    map_length(len, r);
+    EMU_EXPECT_EQ_UINT(len, 3);
+
+    map_deinit(r);
+    remove(TEST_LOG);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_replay_into_small_map)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 4);
+    map_log_open(m, TEST_LOG, 1);
+    for (int i = 0; i < 4; ++i)
+        map_set(m, i, i);
+    // an update fits into a full table
+    map_set(m, 1, -1);
+
+    map(int, int) r;
+    map_init(r, test_hash_int, int_eq, 2);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    int ans;
+    map_get(ans, r, 1);
+    EMU_EXPECT_EQ_INT(ans, -1);
+    map_deinit(r);
+
+    // a fifth key doesn't fit into four buckets
+    map_set(m, 4, 4);
+    map_init(r, test_hash_int, int_eq, 2);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_EXPECT_EQ(r.status, MAP_INPUT_OUT_OF_RANGE);
+    map_deinit(r);
+
+    // and neither do five keys from a snapshot
+    map_log_compact(m, TEST_SNAPSHOT);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    map_init(r, test_hash_int, int_eq, 2);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_EXPECT_EQ(r.status, MAP_INPUT_OUT_OF_RANGE);
+
+    map_deinit(r);
+    map_deinit(m);
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    EMU_END_TEST();
+}
+
+EMU_TEST(log_failed_commit)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) m;
+    map_init(m, test_hash_int, int_eq, 8);
+    map_log_open(m, TEST_LOG, 1);
+    map_set(m, 1, 10);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+
+    // make every write to the log fail
+    int fd = open("/dev/null", O_RDONLY);
+    dup2(fd, m._log->fd);
+    close(fd);
+    map_set(m, 2, 20);
+    EMU_EXPECT_EQ(m.status, MAP_IO_FAILURE);
+    // the log refuses records once a commit failed
+    map_set(m, 3, 30);
+    EMU_EXPECT_EQ(m.status, MAP_IO_FAILURE);
+    map_log_sync(m);
+    EMU_EXPECT_EQ(m.status, MAP_IO_FAILURE);
+    size_t len;
+    map_length(len, m);
+    EMU_EXPECT_EQ_UINT(len, 3);
+
+    // compacting writes out everything and starts a fresh log
+    map_log_compact(m, TEST_SNAPSHOT);
+    EMU_REQUIRE_EQ(m.status, MAP_SUCCESS);
+    map_set(m, 4, 40);
+    EMU_EXPECT_EQ(m.status, MAP_SUCCESS);
+    map_deinit(m);
+
+    map(int, int) r;
+    map_init(r, test_hash_int, int_eq, 8);
+    map_log_replay(r, TEST_SNAPSHOT, TEST_LOG);
+    EMU_REQUIRE_EQ(r.status, MAP_SUCCESS);
+    map_length(len, r);
+    EMU_EXPECT_EQ_UINT(len, 4);
+    int ans;
+    map_get(ans, r, 3);
+    EMU_EXPECT_EQ_INT(ans, 30);
+
+    map_deinit(r);
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(write_ahead_log)
+{
+    EMU_ADD(log_open_and_close);
+    EMU_ADD(log_group_commit);
+    EMU_ADD(log_replay);
+    EMU_ADD(log_compact);
+    EMU_ADD(log_torn_record);
+    EMU_ADD(log_replay_into_small_map);
+    EMU_ADD(log_failed_commit);
+    EMU_END_GROUP();
+}
+
+void sum_values(void* dst_value, void* src_value)
+{
+    *(int*)dst_value += *(int*)src_value;
+}
+
+EMU_TEST(merge_disjoint)
+{
+    map(int, int) dst;
+    map(int, int) src;
+    map_init(dst, test_hash_int, int_eq, 8);
+    map_init(src, test_hash_int, int_eq, 8);
+    for (int i = 0; i < 50; ++i)
+    {
+        map_set(dst, i, i);
+        map_set(src, i + 1000, -i);
+    }
+
+    map_merge(dst, src, NULL);
+    EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+    EMU_EXPECT_EQ_UINT(dst._bits, 8);
+    size_t len;
+    map_length(len, dst);
+    EMU_EXPECT_EQ_UINT(len, 100);
+    for (int i = 0; i < 50; ++i)
+    {
+        int ans;
+        map_get(ans, dst, i);
+        EMU_EXPECT_EQ_INT(ans, i);
+        map_get(ans, dst, i + 1000);
+        EMU_EXPECT_EQ_INT(ans, -i);
+    }
+    // src is left untouched
+    map_length(len, src);
+    EMU_EXPECT_EQ_UINT(len, 50);
+
+    map_deinit(dst);
+    map_deinit(src);
+    EMU_END_TEST();
+}
+
+EMU_TEST(merge_conflicts)
+{
+    map(int, int) dst;
+    map(int, int) src;
+    map_init(dst, test_hash_int, int_eq, 6);
+    map_init(src, test_hash_int, int_eq, 6);
+    for (int i = 0; i < 10; ++i)
+    {
+        map_set(dst, i, 1);
+        map_set(src, i + 5, 10);
+    }
+
+    map_merge(dst, src, sum_values);
+    EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+    int ans;
+    map_get(ans, dst, 0);
+    EMU_EXPECT_EQ_INT(ans, 1);
+    map_get(ans, dst, 7);
+    EMU_EXPECT_EQ_INT(ans, 11);
+    map_get(ans, dst, 14);
+    EMU_EXPECT_EQ_INT(ans, 10);
+
+    // without a conflict function the value from src wins
+    map_merge(dst, src, NULL);
+    map_get(ans, dst, 7);
+    EMU_EXPECT_EQ_INT(ans, 10);
+    size_t len;
+    map_length(len, dst);
+    EMU_EXPECT_EQ_UINT(len, 15);
+
+    map_deinit(dst);
+    map_deinit(src);
+    EMU_END_TEST();
+}
+
+EMU_TEST(merge_grows_destination)
+{
+    map(int, int) dst;
+    map(int, int) src;
+    map_init(dst, test_hash_int, int_eq, 2);
+    map_init(src, test_hash_int, int_eq, 10);
+    map_filter_enable(dst, 0.01);
+    map_set(dst, 1, 1);
+    map_set(dst, 2, 2);
+    for (int i = 0; i < 600; ++i)
+        map_set(src, i * 5, i);
+
+    map_merge(dst, src, NULL);
+    EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+    double lf;
+    map_load_factor(lf, dst);
+    EMU_EXPECT_TRUE(lf <= MAP_MERGE_MAX_LOAD);
+    EMU_EXPECT_EQ_UINT(dst._bits, 10);
+    // the prefilter was resized along with the table
+    EMU_EXPECT_TRUE(dst._filter->nblocks > 1);
+    int ans;
+    map_get(ans, dst, 2);
+    EMU_EXPECT_EQ_INT(ans, 2);
+    for (int i = 0; i < 600; ++i)
+    {
+        map_get(ans, dst, i * 5);
+        EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+        EMU_EXPECT_EQ_INT(ans, i);
+    }
+
+    map_deinit(dst);
+    map_deinit(src);
+    EMU_END_TEST();
+}
+
+EMU_TEST(merge_different_hash_functions)
+{
+    map(int, int) dst;
+    map(int, int) src;
+    map_init(dst, int32_hash, int_eq, 8);
+    map_init(src, test_hash_int, int_eq, 8);
+    for (int i = 0; i < 100; ++i)
+        map_set(src, i, i);
+
+    map_merge(dst, src, NULL);
+    EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+    for (int i = 0; i < 100; ++i)
+    {
+        bool exists;
+        map_key_exists(exists, dst, i);
+        EMU_EXPECT_TRUE(exists);
+    }
+
+    map_deinit(dst);
+    map_deinit(src);
+    EMU_END_TEST();
+}
+
+EMU_TEST(merge_is_logged)
+{
+    remove(TEST_LOG);
+    remove(TEST_SNAPSHOT);
+    map(int, int) dst;
+    map(int, int) src;
+    map_init(dst, test_hash_int, int_eq, 6);
+    map_init(src, test_hash_int, int_eq, 6);
+    map_log_open(dst, TEST_LOG, 8);
+    map_set(dst, 1, 1);
+    map_set(dst, 3, 4);
+    map_set(src, 1, 2);
+    map_set(src, 2, 3);
+    // 65 shares the home bucket of 1, so merging 2 displaces 3
+    map_set(src, 65, 7);
+
+    map_merge(dst, src, sum_values);
+    EMU_REQUIRE_EQ(dst.status, MAP_SUCCESS);
+    map_deinit(dst);
+
+    map_init(dst, test_hash_int, int_eq, 6);
+    map_log_replay(dst, TEST_SNAPSHOT, TEST_LOG);
+    int ans;
+    map_get(ans, dst, 1);
+    EMU_EXPECT_EQ_INT(ans, 3);
+    map_get(ans, dst, 2);
+    EMU_EXPECT_EQ_INT(ans, 3);
+    map_get(ans, dst, 3);
+    EMU_EXPECT_EQ_INT(ans, 4);
+    map_get(ans, dst, 65);
+    EMU_EXPECT_EQ_INT(ans, 7);
+
+    map_deinit(dst);
+    map_deinit(src);
+    remove(TEST_LOG);
+    EMU_END_TEST();
+}
+
+EMU_GROUP(map_merge)
+{
+    EMU_ADD(merge_disjoint);
+    EMU_ADD(merge_conflicts);
+    EMU_ADD(merge_grows_destination);
+    EMU_ADD(merge_different_hash_functions);
+    EMU_ADD(merge_is_logged);
+    EMU_END_GROUP();
+}
+
 EMU_GROUP(macro_unit_tests)
 {
     EMU_ADD(init_and_deinit);
     EMU_ADD(map_set);
     EMU_ADD(map_key_exists);
+    EMU_ADD(key_exists_past_displaced_run);
+    EMU_ADD(str_keys_compare_contents);
     EMU_ADD(map_get);
     EMU_ADD(map_remove);
     EMU_ADD(map_length);
     EMU_ADD(map_load_factor);
     EMU_ADD(map_keys);
+    EMU_ADD(out_of_line_values);
+    EMU_ADD(parallel_traversal);
+    EMU_ADD(frozen_maps);
+    EMU_ADD(lookup_prefilter);
+    EMU_ADD(write_ahead_log);
+    EMU_ADD(map_merge);
     EMU_END_GROUP();
 }
 